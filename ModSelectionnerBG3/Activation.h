@@ -0,0 +1,340 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include "BlobStore.h"
+#include "CopyEngine.h"
+#include "Journal.h"
+#include "Links.h"
+#include "Scanner.h"
+
+namespace fs = std::filesystem;
+
+// Incremental activation: compares a folder with a manifest and only touches
+// the files that actually differ.
+namespace Activation
+{
+	constexpr const char* StagingSuffix = ".staging";
+	constexpr const char* RetiredSuffix = ".old";
+
+	struct Plan
+	{
+		std::vector<fs::path> to_remove;
+		std::vector<BlobStore::ManifestEntry> to_add;
+		std::vector<BlobStore::ManifestEntry> to_keep;
+		size_t unchanged_files = 0;
+		uintmax_t unchanged_bytes = 0;
+		uintmax_t bytes_to_add = 0;
+	};
+
+	struct Result
+	{
+		size_t removed = 0;
+		CopyEngine::Report copy;
+	};
+
+	// A file is kept when its name, size and mtime match the manifest entry.
+	// With verify_hash, files whose mtime differs are hashed, all cores at once,
+	// and kept if their content matches.
+	Plan BuildPlan(const BlobStore::Manifest& manifest, const fs::path& folder, bool verify_hash)
+	{
+		std::map<std::string, const BlobStore::ManifestEntry*> wanted;
+		for (const auto& entry : manifest)
+		{
+			wanted[entry.name] = &entry;
+		}
+
+		Plan plan;
+		std::vector<std::pair<fs::path, const BlobStore::ManifestEntry*>> to_verify;
+		auto keep = [&](const BlobStore::ManifestEntry& entry)
+			{
+				plan.to_keep.push_back(entry);
+				plan.unchanged_files++;
+				plan.unchanged_bytes += entry.size;
+				wanted.erase(entry.name);
+			};
+
+		// Files in directories that cannot be listed are missed, and replaced like changed ones.
+		for (const auto& file : Scanner::Scan(folder).files)
+		{
+			fs::path path = folder / Scanner::PathOf(file.name);
+			auto it = wanted.find(file.name);
+			if (it == wanted.end() || file.size != it->second->size)
+			{
+				plan.to_remove.push_back(path);
+				continue;
+			}
+
+			if (file.mtime == it->second->mtime)
+			{
+				keep(*it->second);
+			}
+			else if (verify_hash)
+			{
+				to_verify.push_back({ path, it->second });
+			}
+			else
+			{
+				plan.to_remove.push_back(path);
+			}
+		}
+
+		std::vector<char> matches(to_verify.size(), 0);
+		CopyEngine::ParallelFor(to_verify.size(), 0, [&](size_t i)
+			{
+				try
+				{
+					matches[i] = Hash::ToHex(Fingerprint::HashFile(to_verify[i].first)) == to_verify[i].second->hash;
+				}
+				catch (const std::exception&)
+				{
+					// An unreadable file is replaced like a changed one.
+				}
+			});
+		for (size_t i = 0; i < to_verify.size(); i++)
+		{
+			if (matches[i])
+			{
+				keep(*to_verify[i].second);
+			}
+			else
+			{
+				plan.to_remove.push_back(to_verify[i].first);
+			}
+		}
+
+		for (const auto& entry : manifest)
+		{
+			if (wanted.contains(entry.name))
+			{
+				plan.to_add.push_back(entry);
+				plan.bytes_to_add += entry.size;
+			}
+		}
+		return plan;
+	}
+
+	// The entries whose blob still holds their content. The others are reported
+	// in errors and left out, so that a pak modified in the store is never installed.
+	std::vector<BlobStore::ManifestEntry> IntactEntries(const fs::path& storage_path, const std::vector<BlobStore::ManifestEntry>& entries, unsigned parallelism, std::vector<CopyEngine::Error>& errors)
+	{
+		std::vector<char> intact(entries.size(), 0);
+		CopyEngine::ParallelFor(entries.size(), parallelism, [&](size_t i) { intact[i] = BlobStore::VerifyBlob(storage_path, entries[i]); });
+
+		std::vector<BlobStore::ManifestEntry> result;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (intact[i])
+			{
+				result.push_back(entries[i]);
+			}
+			else
+			{
+				errors.push_back({ BlobStore::BlobPath(storage_path, entries[i]), "the stored copy of " + entries[i].name + " is missing or was modified" });
+			}
+		}
+		return result;
+	}
+
+	// Every operation is recorded in journal, when given, before the first one runs.
+	Result Apply(const fs::path& storage_path, const Plan& plan, const fs::path& folder, unsigned parallelism, CopyBackend::Tier first_tier, Journal::Writer* journal = nullptr)
+	{
+		Result result;
+		fs::create_directories(folder);
+
+		std::vector<uint64_t> remove_ids(plan.to_remove.size(), 0);
+		std::vector<CopyEngine::Job> jobs;
+		jobs.reserve(plan.to_add.size());
+		for (const auto& entry : IntactEntries(storage_path, plan.to_add, parallelism, result.copy.errors))
+		{
+			jobs.push_back({ BlobStore::BlobPath(storage_path, entry), folder / Scanner::PathOf(entry.name), entry.size, first_tier });
+		}
+		if (journal)
+		{
+			for (size_t i = 0; i < plan.to_remove.size(); i++)
+			{
+				remove_ids[i] = journal->Add(Journal::OpKind::Remove, plan.to_remove[i], {});
+			}
+			for (auto& job : jobs)
+			{
+				job.journal_id = journal->Add(Journal::OpKind::Copy, job.source, job.destination, job.size, job.first_tier);
+			}
+			journal->Flush();
+		}
+
+		for (size_t i = 0; i < plan.to_remove.size(); i++)
+		{
+			std::error_code ec = CopyBackend::RemoveFile(plan.to_remove[i]);
+			if (ec)
+			{
+				result.copy.errors.push_back({ plan.to_remove[i], ec.message() });
+				continue;
+			}
+			if (journal)
+			{
+				journal->Done(remove_ids[i]);
+			}
+			result.removed++;
+		}
+
+		CopyEngine::Report copy = CopyEngine::Run(std::move(jobs), parallelism, journal ? journal->DoneCallback() : nullptr);
+		copy.errors.insert(copy.errors.begin(), result.copy.errors.begin(), result.copy.errors.end());
+		result.copy = std::move(copy);
+		return result;
+	}
+
+	fs::path SiblingPath(const fs::path& folder, const std::string& suffix)
+	{
+		fs::path sibling = folder;
+		sibling += suffix;
+		return sibling;
+	}
+
+	// Builds the new tree in a staging folder beside folder while folder stays live.
+	// Kept files are hard linked from the live folder, the others come from the store.
+	Result Stage(const fs::path& storage_path, const Plan& plan, const fs::path& folder, unsigned parallelism, CopyBackend::Tier first_tier, Journal::Writer* journal = nullptr)
+	{
+		fs::path staging = SiblingPath(folder, StagingSuffix);
+		BatchIo::RemoveTree(staging, parallelism);
+		fs::create_directories(staging);
+
+		std::vector<CopyEngine::Job> jobs;
+		jobs.reserve(plan.to_keep.size() + plan.to_add.size());
+		for (const auto& entry : plan.to_keep)
+		{
+			jobs.push_back({ folder / Scanner::PathOf(entry.name), staging / Scanner::PathOf(entry.name), entry.size, CopyBackend::Tier::Link });
+		}
+		std::vector<CopyEngine::Error> errors;
+		for (const auto& entry : IntactEntries(storage_path, plan.to_add, parallelism, errors))
+		{
+			jobs.push_back({ BlobStore::BlobPath(storage_path, entry), staging / Scanner::PathOf(entry.name), entry.size, first_tier });
+		}
+		if (journal)
+		{
+			for (auto& job : jobs)
+			{
+				job.journal_id = journal->Add(Journal::OpKind::Copy, job.source, job.destination, job.size, job.first_tier);
+			}
+			journal->Flush();
+		}
+
+		Result result;
+		result.removed = plan.to_remove.size();
+		result.copy = CopyEngine::Run(std::move(jobs), parallelism, journal ? journal->DoneCallback() : nullptr);
+		result.copy.errors.insert(result.copy.errors.begin(), errors.begin(), errors.end());
+		return result;
+	}
+
+	// Where the current folder goes when it is replaced. A switch interrupted
+	// between the two renames is found again by RecoverInterruptedSwitch.
+	fs::path RetiredPath(const fs::path& folder)
+	{
+		return SiblingPath(folder, RetiredSuffix + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()));
+	}
+
+	// Puts the staged tree in place of folder with two renames and returns the
+	// retired tree, which the caller deletes. On failure folder is left as it was.
+	std::error_code SwapStaged(const fs::path& folder, fs::path& retired)
+	{
+		fs::path staging = SiblingPath(folder, StagingSuffix);
+		retired = RetiredPath(folder);
+
+		std::error_code ec;
+		if (fs::exists(folder))
+		{
+			fs::rename(folder, retired, ec);
+			if (ec)
+			{
+				return ec;
+			}
+		}
+
+		fs::rename(staging, folder, ec);
+		if (ec)
+		{
+			std::error_code restore;
+			fs::rename(retired, folder, restore);
+		}
+		return ec;
+	}
+
+	// Cleans up after a switch interrupted by a crash: a staging tree is simply
+	// dropped, and a retired tree is put back if the swap never completed.
+	// Returns the retired trees left to delete.
+	std::vector<fs::path> RecoverInterruptedSwitch(const fs::path& folder)
+	{
+		std::error_code ec;
+		BatchIo::RemoveTree(SiblingPath(folder, StagingSuffix));
+
+		std::vector<fs::path> retired;
+		fs::path parent = folder.parent_path();
+		if (!fs::exists(parent))
+		{
+			return retired;
+		}
+
+		std::string prefix = folder.filename().string() + RetiredSuffix;
+		for (const auto& entry : fs::directory_iterator(parent))
+		{
+			if (entry.is_directory() && entry.path().filename().string().starts_with(prefix))
+			{
+				retired.push_back(entry.path());
+			}
+		}
+
+		if (!fs::exists(folder) && !retired.empty())
+		{
+			std::sort(retired.begin(), retired.end());
+			fs::rename(retired.back(), folder, ec);
+			if (!ec)
+			{
+				retired.pop_back();
+			}
+		}
+		return retired;
+	}
+
+	// A Mods folder left as a junction by the link mode must become a real folder
+	// again before files are written into it, or they would land in the profile.
+	std::error_code DetachLinkedFolder(const fs::path& folder)
+	{
+		if (!Links::IsLink(folder))
+		{
+			return {};
+		}
+		return Links::RemoveLink(folder);
+	}
+
+	// Replaces destination by source, as a symbolic link when as_link is set and
+	// links are usable, as a copy otherwise. Returns true when a link was created.
+	bool InstallFile(const fs::path& source, const fs::path& destination, bool as_link)
+	{
+		std::error_code ec;
+		if (Links::IsLink(destination))
+		{
+			Links::RemoveLink(destination);
+		}
+
+		if (as_link)
+		{
+			fs::remove(destination, ec);
+			if (!Links::CreateFileSymlink(destination, source))
+			{
+				return true;
+			}
+		}
+
+		fs::create_directories(destination.parent_path(), ec);
+		fs::copy_file(source, destination, fs::copy_options::overwrite_existing);
+		return false;
+	}
+
+	Result Synchronize(const fs::path& storage_path, const BlobStore::Manifest& manifest, const fs::path& folder, bool verify_hash, unsigned parallelism, CopyBackend::Tier first_tier, Journal::Writer* journal = nullptr)
+	{
+		return Apply(storage_path, BuildPlan(manifest, folder, verify_hash), folder, parallelism, first_tier, journal);
+	}
+}
@@ -0,0 +1,458 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include <filesystem>
+#include "CopyEngine.h"
+#include "Fingerprint.h"
+#include "Hash.h"
+#include "Journal.h"
+#include "Pipeline.h"
+#include "Scanner.h"
+#include "JSON/json.hpp"
+
+namespace fs = std::filesystem;
+
+// Content-addressed storage for mod files.
+// Every unique file lives once under <mods_storage_path>\.blobs, named after its
+// content hash and size. Profiles only keep a manifest of (name -> blob) and a
+// "Mods" folder made of hard links into the store, so a profile switch links
+// files instead of copying their bytes.
+// Blobs are shared through hard links: a pak must be replaced, never rewritten in
+// place. Blobs stay writable, since the Mods folder links to them, so a blob is
+// checked again before it is installed once its mtime no longer matches.
+namespace BlobStore
+{
+	constexpr const char* BlobsFolderName = ".blobs";
+	constexpr const char* ManifestFileName = "manifest.json";
+	constexpr const char* IncomingFolderName = ".incoming";
+
+	struct ManifestEntry
+	{
+		std::string name;
+		uintmax_t size = 0;
+		int64_t mtime = 0;
+		std::string hash;
+	};
+
+	NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(ManifestEntry, name, size, mtime, hash)
+
+	using Manifest = std::vector<ManifestEntry>;
+
+	// What a new snapshot changed compared to the previous manifest of the same folder.
+	struct Changes
+	{
+		std::vector<std::string> added;
+		std::vector<std::string> modified;
+		std::vector<std::string> removed;
+		size_t unchanged = 0;
+		uintmax_t new_bytes = 0;
+	};
+
+	fs::path BlobsRoot(const fs::path& storage_path)
+	{
+		return storage_path / BlobsFolderName;
+	}
+
+	fs::path BlobPath(const fs::path& storage_path, const ManifestEntry& entry)
+	{
+		return BlobsRoot(storage_path) / entry.hash.substr(0, 2) / (entry.hash + "-" + std::to_string(entry.size));
+	}
+
+	// BlobPath relative to BlobsRoot, as Scanner names it.
+	std::string BlobName(const ManifestEntry& entry)
+	{
+		return entry.hash.substr(0, 2) + "/" + entry.hash + "-" + std::to_string(entry.size);
+	}
+
+	Manifest LoadManifest(const fs::path& profile_path)
+	{
+		fs::path manifest_path = profile_path / ManifestFileName;
+		if (!fs::exists(manifest_path))
+		{
+			return {};
+		}
+
+		Manifest manifest;
+		try
+		{
+			std::ifstream file(manifest_path);
+			nlohmann::json parser;
+			file >> parser;
+			manifest = parser.get<Manifest>();
+		}
+		catch (const nlohmann::json::exception& e)
+		{
+			std::cerr << "Erreur: " << e.what() << std::endl;
+		}
+		return manifest;
+	}
+
+	void SaveManifest(const fs::path& profile_path, const Manifest& manifest)
+	{
+		std::ofstream file(profile_path / ManifestFileName);
+		file << nlohmann::json(manifest).dump(4);
+	}
+
+	// Describes a scanned file as a manifest entry without opening it. The hash is
+	// taken from previous when it matches the size and mtime (files already
+	// captured) or from the fingerprint cache, and left empty otherwise.
+	// verify_hash skips both and leaves every hash to be computed from the content.
+	ManifestEntry Describe(const fs::path& storage_path, const fs::path& source_file, const Scanner::Entry& file, uint64_t volume, const ManifestEntry* previous, bool verify_hash)
+	{
+		ManifestEntry entry{ .name = file.name, .size = file.size, .mtime = file.mtime };
+		if (verify_hash)
+		{
+			return entry;
+		}
+
+		if (previous && previous->size == entry.size && previous->mtime == entry.mtime && fs::exists(BlobPath(storage_path, *previous)))
+		{
+			entry.hash = previous->hash;
+		}
+		else if (std::optional<uint64_t> cached = file.file_id ? Fingerprint::GlobalCache.Lookup({ volume, file.file_id, file.size, static_cast<uint64_t>(file.mtime) }) : Fingerprint::CachedHash(source_file))
+		{
+			entry.hash = Hash::ToHex(*cached);
+		}
+		return entry;
+	}
+
+	// Whether the blob of entry still holds its content. A tool rewriting a pak in
+	// place through one of its links rewrites the blob too, and changes its mtime:
+	// a blob whose mtime differs from entry is hashed again, through the
+	// fingerprint cache. A blob whose content changed is dropped from the store.
+	bool VerifyBlob(const fs::path& storage_path, const ManifestEntry& entry)
+	{
+		fs::path blob = BlobPath(storage_path, entry);
+		std::optional<Fingerprint::Key> key = Fingerprint::KeyOf(blob);
+		if (!key || key->size != entry.size)
+		{
+			CopyBackend::RemoveFile(blob);
+			return false;
+		}
+		if (static_cast<int64_t>(key->mtime) == entry.mtime)
+		{
+			return true;
+		}
+
+		try
+		{
+			if (Hash::ToHex(Fingerprint::HashFile(blob)) == entry.hash)
+			{
+				return true;
+			}
+		}
+		catch (const std::exception&)
+		{
+			return false;
+		}
+		CopyBackend::RemoveFile(blob);
+		return false;
+	}
+
+	// Moves a fully written temporary file to blob, or drops it when the store already has that content.
+	void AdoptBlob(const fs::path& temp, const fs::path& blob)
+	{
+		std::error_code ec;
+		if (fs::exists(blob))
+		{
+			CopyBackend::RemoveFile(temp);
+			return;
+		}
+		fs::create_directories(blob.parent_path(), ec);
+		fs::rename(temp, blob, ec);
+	}
+
+	// Builds the manifest of folder and adds its missing blobs to the store.
+	// Every file is read at most once: a file with an unknown hash is hard linked
+	// into the store and hashed there, or, when it cannot be linked (another
+	// volume), copied through the read -> hash -> write pipeline.
+	// Hashing and blob copies run on up to parallelism threads.
+	// Files that cannot be ingested are left out of the manifest and reported in errors.
+	Manifest Snapshot(const fs::path& storage_path, const fs::path& folder, const Manifest& previous, bool verify_hash, unsigned parallelism, std::vector<CopyEngine::Error>& errors, Journal::Writer* journal = nullptr)
+	{
+		std::map<std::string, const ManifestEntry*> known;
+		for (const auto& entry : previous)
+		{
+			known[entry.name] = &entry;
+		}
+
+		if (!fs::exists(folder))
+		{
+			return {};
+		}
+
+		Scanner::Result scan = Scanner::Scan(folder, parallelism);
+		for (const auto& [path, ec] : scan.errors)
+		{
+			errors.push_back({ path, ec.message() });
+		}
+		std::vector<fs::path> files;
+		files.reserve(scan.files.size());
+		for (const auto& file : scan.files)
+		{
+			files.push_back(folder / Scanner::PathOf(file.name));
+		}
+
+		fs::path incoming = BlobsRoot(storage_path) / IncomingFolderName;
+		std::error_code ec;
+		BatchIo::RemoveTree(incoming, parallelism);
+		fs::create_directories(incoming, ec);
+		auto incoming_path = [&](size_t i) { return incoming / std::to_string(i); };
+
+		std::vector<ManifestEntry> entries(files.size());
+		std::vector<char> described(files.size(), 0);
+		std::vector<char> linked(files.size(), 0);
+		std::vector<size_t> to_pipe;
+		std::mutex errors_mutex;
+		CopyEngine::ParallelFor(files.size(), parallelism, [&](size_t i)
+			{
+				auto it = known.find(scan.files[i].name);
+				try
+				{
+					entries[i] = Describe(storage_path, files[i], scan.files[i], scan.volume, it == known.end() ? nullptr : it->second, verify_hash);
+					if (entries[i].hash.empty())
+					{
+						std::error_code link_error;
+						fs::create_hard_link(files[i], incoming_path(i), link_error);
+						if (link_error)
+						{
+							std::lock_guard lock(errors_mutex);
+							to_pipe.push_back(i);
+							return;
+						}
+						entries[i].hash = Hash::ToHex(Fingerprint::HashFile(incoming_path(i), !verify_hash));
+						linked[i] = 1;
+					}
+					described[i] = 1;
+				}
+				catch (const std::exception& e)
+				{
+					std::lock_guard lock(errors_mutex);
+					errors.push_back({ files[i], e.what() });
+				}
+			});
+
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			if (linked[i])
+			{
+				AdoptBlob(incoming_path(i), BlobPath(storage_path, entries[i]));
+			}
+		}
+
+		std::vector<Pipeline::Item> items;
+		for (size_t i : to_pipe)
+		{
+			items.push_back({ files[i], incoming_path(i) });
+		}
+		std::vector<Pipeline::Outcome> outcomes = Pipeline::HashAndCopy(items);
+		for (size_t p = 0; p < to_pipe.size(); p++)
+		{
+			size_t i = to_pipe[p];
+			if (outcomes[p].error)
+			{
+				errors.push_back({ files[i], outcomes[p].error.message() });
+				fs::remove(incoming_path(i), ec);
+				continue;
+			}
+			entries[i].hash = Hash::ToHex(outcomes[p].hash);
+			described[i] = 1;
+			Fingerprint::Remember(files[i], outcomes[p].hash);
+			AdoptBlob(incoming_path(i), BlobPath(storage_path, entries[i]));
+		}
+
+		// Files whose hash was already known but whose blob is missing.
+		// Blobs are written under a temporary name and renamed once complete.
+		std::vector<CopyEngine::Job> jobs;
+		std::set<fs::path> pending;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (!described[i])
+			{
+				continue;
+			}
+
+			fs::path blob = BlobPath(storage_path, entries[i]);
+			if (fs::exists(blob) || !pending.insert(blob).second)
+			{
+				continue;
+			}
+
+			fs::path temp = blob;
+			temp += ".tmp";
+			fs::remove(temp, ec);
+			jobs.push_back({ files[i], temp, entries[i].size, CopyBackend::Tier::Link });
+		}
+
+		std::vector<uint64_t> rename_ids(jobs.size(), 0);
+		if (journal)
+		{
+			for (size_t j = 0; j < jobs.size(); j++)
+			{
+				fs::path blob = jobs[j].destination;
+				blob.replace_extension();
+				jobs[j].journal_id = journal->Add(Journal::OpKind::Copy, jobs[j].source, jobs[j].destination, jobs[j].size, jobs[j].first_tier);
+				rename_ids[j] = journal->Add(Journal::OpKind::Rename, jobs[j].destination, blob);
+			}
+			journal->Flush();
+		}
+
+		CopyEngine::Report report = CopyEngine::Run(jobs, parallelism, journal ? journal->DoneCallback() : nullptr);
+		std::set<fs::path> failed;
+		for (const auto& error : report.errors)
+		{
+			failed.insert(error.path);
+			errors.push_back(error);
+		}
+
+		for (size_t j = 0; j < jobs.size(); j++)
+		{
+			if (failed.contains(jobs[j].destination))
+			{
+				continue;
+			}
+			fs::path blob = jobs[j].destination;
+			blob.replace_extension();
+			fs::rename(jobs[j].destination, blob);
+			if (journal)
+			{
+				journal->Done(rename_ids[j]);
+			}
+		}
+
+		Manifest manifest;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (described[i] && fs::exists(BlobPath(storage_path, entries[i])))
+			{
+				manifest.push_back(std::move(entries[i]));
+			}
+		}
+		return manifest;
+	}
+
+	// Merkle root of the tree described by manifest: a file hashes its name, size
+	// and content hash, and a directory the names and hashes of its children.
+	// Equal trees give equal roots whatever the order of the manifest, and any
+	// unknown content hash makes the root differ.
+	uint64_t TreeHash(const Manifest& manifest)
+	{
+		std::vector<const ManifestEntry*> entries;
+		entries.reserve(manifest.size());
+		for (const auto& entry : manifest)
+		{
+			entries.push_back(&entry);
+		}
+		// Sorted names keep every directory contiguous: whatever lies between two
+		// names shares their common prefix.
+		std::sort(entries.begin(), entries.end(), [](const ManifestEntry* lhs, const ManifestEntry* rhs) { return lhs->name < rhs->name; });
+
+		size_t next = 0;
+		auto node = [&](auto& self, std::string_view prefix) -> uint64_t
+			{
+				Hash::Hasher hasher;
+				while (next < entries.size() && std::string_view(entries[next]->name).starts_with(prefix))
+				{
+					std::string_view name = std::string_view(entries[next]->name).substr(prefix.size());
+					size_t slash = name.find('/');
+					if (slash == std::string_view::npos)
+					{
+						uint64_t size = entries[next]->size;
+						hasher.Update(name.data(), name.size() + 1);
+						hasher.Update(&size, sizeof(size));
+						hasher.Update(entries[next]->hash.data(), entries[next]->hash.size() + 1);
+						next++;
+						continue;
+					}
+
+					std::string child(entries[next]->name.substr(0, prefix.size() + slash + 1));
+					uint64_t child_hash = self(self, child);
+					hasher.Update(child.data() + prefix.size(), slash + 1);
+					hasher.Update(&child_hash, sizeof(child_hash));
+				}
+				return hasher.Final();
+			};
+		return node(node, std::string_view());
+	}
+
+	Changes Compare(const Manifest& previous, const Manifest& current)
+	{
+		std::map<std::string, const ManifestEntry*> known;
+		for (const auto& entry : previous)
+		{
+			known[entry.name] = &entry;
+		}
+
+		Changes changes;
+		for (const auto& entry : current)
+		{
+			auto it = known.find(entry.name);
+			if (it == known.end())
+			{
+				changes.added.push_back(entry.name);
+				changes.new_bytes += entry.size;
+				continue;
+			}
+
+			if (it->second->hash != entry.hash || it->second->size != entry.size)
+			{
+				changes.modified.push_back(entry.name);
+				changes.new_bytes += entry.size;
+			}
+			else
+			{
+				changes.unchanged++;
+			}
+			known.erase(it);
+		}
+
+		for (const auto& [name, entry] : known)
+		{
+			changes.removed.push_back(name);
+		}
+		return changes;
+	}
+
+	// Removes every blob that is not referenced by one of the given manifests.
+	size_t CollectGarbage(const fs::path& storage_path, const std::vector<Manifest>& manifests)
+	{
+		fs::path root = BlobsRoot(storage_path);
+		if (!fs::exists(root))
+		{
+			return 0;
+		}
+
+		std::set<std::string> referenced;
+		for (const auto& manifest : manifests)
+		{
+			for (const auto& entry : manifest)
+			{
+				referenced.insert(BlobName(entry));
+			}
+		}
+
+		std::vector<fs::path> orphans;
+		for (const auto& file : Scanner::Scan(root).files)
+		{
+			if (!referenced.contains(file.name))
+			{
+				orphans.push_back(root / Scanner::PathOf(file.name));
+			}
+		}
+
+		for (const auto& path : orphans)
+		{
+			CopyBackend::RemoveFile(path);
+		}
+		return orphans.size();
+	}
+}
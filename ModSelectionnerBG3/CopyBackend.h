@@ -0,0 +1,291 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+
+namespace fs = std::filesystem;
+
+// Single-file copy primitives, tried from cheapest to most expensive:
+// hard link, block clone (ReFS / Dev Drive copy-on-write), the kernel copy
+// engine (CopyFileEx, which can offload to the storage), then a plain
+// buffered copy. The tier that succeeded is reported for every file.
+namespace CopyBackend
+{
+	constexpr DWORD IoBlockSize = 4 << 20;
+	constexpr LONGLONG MaxCloneChunk = 1ll << 30;
+
+	enum class Tier
+	{
+		Link,
+		Clone,
+		Kernel,
+		Buffered,
+		Chunked,
+		Overlapped,
+		Count,
+	};
+
+	constexpr const char* TierNames[] = { "hard link", "block clone", "kernel copy", "buffered copy", "chunked copy", "overlapped copy" };
+
+	struct Result
+	{
+		Tier tier = Tier::Buffered;
+		std::error_code error;
+	};
+
+	class FileHandle
+	{
+	public:
+		explicit FileHandle(HANDLE handle) : handle(handle) {}
+		~FileHandle()
+		{
+			if (IsValid())
+			{
+				CloseHandle(handle);
+			}
+		}
+		FileHandle(const FileHandle&) = delete;
+		FileHandle& operator=(const FileHandle&) = delete;
+
+		bool IsValid() const { return handle != INVALID_HANDLE_VALUE; }
+		void Close()
+		{
+			if (IsValid())
+			{
+				CloseHandle(handle);
+				handle = INVALID_HANDLE_VALUE;
+			}
+		}
+		HANDLE Get() const { return handle; }
+
+	private:
+		HANDLE handle;
+	};
+
+	std::error_code LastError()
+	{
+		return std::error_code(static_cast<int>(GetLastError()), std::system_category());
+	}
+
+	// Deletes a file with POSIX semantics: its name disappears at once even if
+	// the game or an antivirus still holds it open, and read-only files go too.
+	std::error_code RemoveFile(const fs::path& path)
+	{
+		FileHandle file(CreateFileW(path.c_str(), DELETE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, nullptr));
+		if (!file.IsValid())
+		{
+			return LastError();
+		}
+
+		FILE_DISPOSITION_INFO_EX disposition{};
+		disposition.Flags = FILE_DISPOSITION_FLAG_DELETE | FILE_DISPOSITION_FLAG_POSIX_SEMANTICS | FILE_DISPOSITION_FLAG_IGNORE_READONLY_ATTRIBUTE;
+		if (SetFileInformationByHandle(file.Get(), FileDispositionInfoEx, &disposition, sizeof(disposition)))
+		{
+			return {};
+		}
+
+		// Older Windows versions and FAT volumes only know the classic delete.
+		file.Close();
+		std::error_code ec;
+		fs::remove(path, ec);
+		return ec;
+	}
+
+	// Creates destination with its final size so ranges can be written at any offset.
+	std::error_code Preallocate(const fs::path& destination, uintmax_t size)
+	{
+		FileHandle file(CreateFileW(destination.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+		if (!file.IsValid())
+		{
+			return LastError();
+		}
+
+		LARGE_INTEGER end{};
+		end.QuadPart = static_cast<LONGLONG>(size);
+		if (!SetFilePointerEx(file.Get(), end, nullptr, FILE_BEGIN) || !SetEndOfFile(file.Get()))
+		{
+			return LastError();
+		}
+		return {};
+	}
+
+	// Copies [offset, offset + length) with positional reads and writes.
+	std::error_code CopyRange(const fs::path& source, const fs::path& destination, uintmax_t offset, uintmax_t length)
+	{
+		FileHandle input(CreateFileW(source.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+		if (!input.IsValid())
+		{
+			return LastError();
+		}
+		FileHandle output(CreateFileW(destination.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+		if (!output.IsValid())
+		{
+			return LastError();
+		}
+
+		std::vector<char> buffer(static_cast<size_t>(std::min<uintmax_t>(IoBlockSize, length)));
+		while (length > 0)
+		{
+			DWORD to_read = static_cast<DWORD>(std::min<uintmax_t>(buffer.size(), length));
+			OVERLAPPED position{};
+			position.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+			position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+			DWORD read = 0;
+			if (!ReadFile(input.Get(), buffer.data(), to_read, &read, &position))
+			{
+				return LastError();
+			}
+			if (read != to_read)
+			{
+				return std::make_error_code(std::errc::io_error);
+			}
+
+			DWORD written = 0;
+			if (!WriteFile(output.Get(), buffer.data(), read, &written, &position) || written != read)
+			{
+				return LastError();
+			}
+
+			offset += read;
+			length -= read;
+		}
+		return {};
+	}
+
+	DWORD GetClusterSize(const fs::path& path)
+	{
+		wchar_t volume[MAX_PATH] = {};
+		DWORD sectors_per_cluster = 0;
+		DWORD bytes_per_sector = 0;
+		DWORD free_clusters = 0;
+		DWORD total_clusters = 0;
+		if (!GetVolumePathNameW(path.c_str(), volume, MAX_PATH)
+			|| !GetDiskFreeSpaceW(volume, &sectors_per_cluster, &bytes_per_sector, &free_clusters, &total_clusters))
+		{
+			return 0;
+		}
+		return sectors_per_cluster * bytes_per_sector;
+	}
+
+	// Shares the source extents with the destination instead of copying them.
+	// Only succeeds when both files are on the same block-cloning volume.
+	std::error_code CloneFile(const fs::path& source, const fs::path& destination, uintmax_t size)
+	{
+		DWORD cluster_size = GetClusterSize(destination.parent_path());
+		if (cluster_size == 0)
+		{
+			return std::make_error_code(std::errc::not_supported);
+		}
+
+		FileHandle input(CreateFileW(source.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+		if (!input.IsValid())
+		{
+			return LastError();
+		}
+		FileHandle output(CreateFileW(destination.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+		if (!output.IsValid())
+		{
+			return LastError();
+		}
+
+		LARGE_INTEGER end{};
+		end.QuadPart = static_cast<LONGLONG>(size);
+		if (!SetFilePointerEx(output.Get(), end, nullptr, FILE_BEGIN) || !SetEndOfFile(output.Get()))
+		{
+			return LastError();
+		}
+
+		// Clone ranges must be cluster aligned; the last one may run past the end of file.
+		LONGLONG total = (static_cast<LONGLONG>(size) + cluster_size - 1) / cluster_size * cluster_size;
+		for (LONGLONG offset = 0; offset < total; offset += MaxCloneChunk)
+		{
+			DUPLICATE_EXTENTS_DATA extents{};
+			extents.FileHandle = input.Get();
+			extents.SourceFileOffset.QuadPart = offset;
+			extents.TargetFileOffset.QuadPart = offset;
+			extents.ByteCount.QuadPart = std::min(MaxCloneChunk, total - offset);
+
+			DWORD returned = 0;
+			if (!DeviceIoControl(output.Get(), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), nullptr, 0, &returned, nullptr))
+			{
+				return LastError();
+			}
+		}
+		return {};
+	}
+
+	std::error_code KernelCopy(const fs::path& source, const fs::path& destination)
+	{
+		BOOL cancel = FALSE;
+		if (!CopyFileExW(source.c_str(), destination.c_str(), nullptr, nullptr, &cancel, 0))
+		{
+			return LastError();
+		}
+		return {};
+	}
+
+	std::error_code BufferedCopy(const fs::path& source, const fs::path& destination, uintmax_t size)
+	{
+		std::error_code ec = Preallocate(destination, size);
+		if (ec)
+		{
+			return ec;
+		}
+		return CopyRange(source, destination, 0, size);
+	}
+
+	std::error_code CopyMTime(const fs::path& source, const fs::path& destination)
+	{
+		std::error_code ec;
+		fs::file_time_type mtime = fs::last_write_time(source, ec);
+		if (!ec)
+		{
+			fs::last_write_time(destination, mtime, ec);
+		}
+		return ec;
+	}
+
+	// Copies one file with the cheapest tier that works, starting at first_tier.
+	Result CopyWithBestTier(const fs::path& source, const fs::path& destination, uintmax_t size, Tier first_tier)
+	{
+		Result result;
+		std::error_code ec;
+		RemoveFile(destination);
+
+		if (first_tier <= Tier::Link)
+		{
+			fs::create_hard_link(source, destination, ec);
+			if (!ec)
+			{
+				result.tier = Tier::Link;
+				return result;
+			}
+		}
+
+		if (first_tier <= Tier::Clone && !CloneFile(source, destination, size))
+		{
+			result.tier = Tier::Clone;
+			result.error = CopyMTime(source, destination);
+			return result;
+		}
+
+		if (!KernelCopy(source, destination))
+		{
+			result.tier = Tier::Kernel;
+			return result;
+		}
+
+		result.tier = Tier::Buffered;
+		result.error = BufferedCopy(source, destination, size);
+		if (!result.error)
+		{
+			result.error = CopyMTime(source, destination);
+		}
+		return result;
+	}
+}
@@ -0,0 +1,282 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include "BatchIo.h"
+#include "CopyBackend.h"
+
+namespace fs = std::filesystem;
+
+// Bounded worker pool used by every bulk file operation.
+// Jobs are sorted largest-first and pulled from a shared cursor, so the big
+// paks start early and the small ones fill the gaps at the end.
+// Files above ChunkedCopyThreshold are split in byte ranges copied concurrently,
+// so a single huge pak does not end up on one thread.
+// Every file goes through CopyBackend, which picks the cheapest copy tier,
+// except large batches of small files that must be copied byte for byte:
+// those go through the overlapped BatchIo backend on a thread of their own.
+namespace CopyEngine
+{
+	constexpr uintmax_t ChunkedCopyThreshold = 512ull << 20;
+	constexpr uintmax_t ChunkSize = 64ull << 20;
+	constexpr size_t OverlappedMinFiles = 256;
+
+	struct Job
+	{
+		fs::path source;
+		fs::path destination;
+		uintmax_t size = 0;
+		// Cheapest tier worth trying for this job, skipping the ones known to fail.
+		CopyBackend::Tier first_tier = CopyBackend::Tier::Clone;
+		uint64_t journal_id = 0;
+	};
+
+	struct Error
+	{
+		fs::path path;
+		std::string message;
+	};
+
+	struct FileRecord
+	{
+		fs::path path;
+		CopyBackend::Tier tier;
+	};
+
+	struct Report
+	{
+		size_t files = 0;
+		uintmax_t bytes_copied = 0;
+		double seconds = 0.0;
+		std::array<size_t, static_cast<size_t>(CopyBackend::Tier::Count)> by_tier{};
+		std::vector<FileRecord> records;
+		std::vector<Error> errors;
+
+		size_t Linked() const
+		{
+			return by_tier[static_cast<size_t>(CopyBackend::Tier::Link)];
+		}
+
+		double Throughput() const
+		{
+			return seconds > 0.0 ? static_cast<double>(bytes_copied) / seconds : 0.0;
+		}
+	};
+
+	unsigned ResolveParallelism(unsigned parallelism)
+	{
+		if (parallelism == 0)
+		{
+			parallelism = std::max(1u, std::thread::hardware_concurrency());
+		}
+		return parallelism;
+	}
+
+	// Runs task(i) for every i in [0, count) on up to parallelism threads.
+	void ParallelFor(size_t count, unsigned parallelism, const std::function<void(size_t)>& task)
+	{
+		unsigned workers = static_cast<unsigned>(std::min<size_t>(ResolveParallelism(parallelism), count));
+		if (workers <= 1)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				task(i);
+			}
+			return;
+		}
+
+		std::atomic<size_t> cursor = 0;
+		std::vector<std::jthread> threads;
+		threads.reserve(workers);
+		for (unsigned w = 0; w < workers; w++)
+		{
+			threads.emplace_back([&]()
+				{
+					for (size_t i = cursor++; i < count; i = cursor++)
+					{
+						task(i);
+					}
+				});
+		}
+	}
+
+	// on_done is called from the worker threads for every job that succeeded.
+	Report Run(std::vector<Job> jobs, unsigned parallelism, const std::function<void(const Job&)>& on_done = nullptr)
+	{
+		std::sort(jobs.begin(), jobs.end(), [](const Job& lhs, const Job& rhs) { return lhs.size > rhs.size; });
+
+		struct Task
+		{
+			size_t job;
+			uintmax_t offset;
+			uintmax_t length;
+			bool chunk;
+		};
+
+		Report report;
+		std::mutex report_mutex;
+		auto start = std::chrono::steady_clock::now();
+
+		auto finish = [&](const Job& job, CopyBackend::Tier tier, const std::error_code& ec)
+			{
+				std::lock_guard lock(report_mutex);
+				if (ec)
+				{
+					report.errors.push_back({ job.destination, ec.message() });
+					return;
+				}
+				if (on_done)
+				{
+					on_done(job);
+				}
+				report.files++;
+				report.by_tier[static_cast<size_t>(tier)]++;
+				report.records.push_back({ job.destination, tier });
+				if (tier != CopyBackend::Tier::Link && tier != CopyBackend::Tier::Clone)
+				{
+					report.bytes_copied += job.size;
+				}
+			};
+
+		bool split_large_files = ResolveParallelism(parallelism) > 1;
+		std::vector<Task> tasks;
+		std::vector<size_t> batched;
+		std::vector<std::atomic<size_t>> remaining_chunks(jobs.size());
+		std::vector<std::error_code> chunk_errors(jobs.size());
+
+		for (size_t j = 0; j < jobs.size(); j++)
+		{
+			const Job& job = jobs[j];
+			if (!split_large_files || job.size < ChunkedCopyThreshold)
+			{
+				if (job.first_tier >= CopyBackend::Tier::Kernel && job.size < ChunkedCopyThreshold)
+				{
+					batched.push_back(j);
+				}
+				else
+				{
+					tasks.push_back({ j, 0, job.size, false });
+				}
+				continue;
+			}
+
+			// Links and clones cost nothing, only fall back to ranges when neither works.
+			std::error_code ec;
+			fs::create_directories(job.destination.parent_path(), ec);
+			CopyBackend::RemoveFile(job.destination);
+			if (job.first_tier <= CopyBackend::Tier::Link)
+			{
+				fs::create_hard_link(job.source, job.destination, ec);
+				if (!ec)
+				{
+					finish(job, CopyBackend::Tier::Link, ec);
+					continue;
+				}
+			}
+			if (job.first_tier <= CopyBackend::Tier::Clone && !CopyBackend::CloneFile(job.source, job.destination, job.size))
+			{
+				finish(job, CopyBackend::Tier::Clone, CopyBackend::CopyMTime(job.source, job.destination));
+				continue;
+			}
+
+			ec = CopyBackend::Preallocate(job.destination, job.size);
+			if (ec)
+			{
+				finish(job, CopyBackend::Tier::Chunked, ec);
+				continue;
+			}
+
+			size_t chunks = static_cast<size_t>((job.size + ChunkSize - 1) / ChunkSize);
+			remaining_chunks[j] = chunks;
+			for (size_t c = 0; c < chunks; c++)
+			{
+				uintmax_t offset = c * ChunkSize;
+				tasks.push_back({ j, offset, std::min(ChunkSize, job.size - offset), true });
+			}
+		}
+
+		// Too few files to beat the thread pool: give them back to it.
+		if (batched.size() < OverlappedMinFiles)
+		{
+			for (size_t j : batched)
+			{
+				tasks.push_back({ j, 0, jobs[j].size, false });
+			}
+			batched.clear();
+		}
+
+		std::jthread batch_thread;
+		if (!batched.empty())
+		{
+			batch_thread = std::jthread([&]()
+				{
+					std::vector<BatchIo::Transfer> transfers;
+					transfers.reserve(batched.size());
+					for (size_t j : batched)
+					{
+						transfers.push_back({ jobs[j].source, jobs[j].destination, jobs[j].size });
+					}
+					BatchIo::CopyFiles(transfers, [&](size_t t, const std::error_code& ec)
+						{
+							finish(jobs[batched[t]], CopyBackend::Tier::Overlapped, ec);
+						});
+				});
+		}
+
+		ParallelFor(tasks.size(), parallelism, [&](size_t i)
+			{
+				const Task& task = tasks[i];
+				const Job& job = jobs[task.job];
+				std::error_code ec;
+
+				if (task.chunk)
+				{
+					ec = CopyBackend::CopyRange(job.source, job.destination, task.offset, task.length);
+					if (ec)
+					{
+						std::lock_guard lock(report_mutex);
+						if (!chunk_errors[task.job])
+						{
+							chunk_errors[task.job] = ec;
+						}
+					}
+					if (--remaining_chunks[task.job] > 0)
+					{
+						return;
+					}
+
+					ec = chunk_errors[task.job];
+					if (!ec && fs::file_size(job.destination, ec) != job.size && !ec)
+					{
+						ec = std::make_error_code(std::errc::io_error);
+					}
+					if (!ec)
+					{
+						ec = CopyBackend::CopyMTime(job.source, job.destination);
+					}
+					finish(job, CopyBackend::Tier::Chunked, ec);
+					return;
+				}
+
+				fs::create_directories(job.destination.parent_path(), ec);
+				CopyBackend::Result result = CopyBackend::CopyWithBestTier(job.source, job.destination, job.size, job.first_tier);
+				finish(job, result.tier, result.error);
+			});
+		if (batch_thread.joinable())
+		{
+			batch_thread.join();
+		}
+
+		report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return report;
+	}
+}
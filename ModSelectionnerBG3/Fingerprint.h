@@ -0,0 +1,375 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "CopyBackend.h"
+#include "Hash.h"
+
+namespace fs = std::filesystem;
+
+// Persistent cache of content hashes, keyed by the identity of the file on disk.
+// A file is known by its volume serial number and file ID, and its cached hash
+// is only trusted while its size and last write time are unchanged. Hard links
+// share a file ID, so a pak linked into the store, a profile and the Mods folder
+// is hashed once. A file whose ID does not fit in 64 bits (ReFS) is never cached:
+// the 64-bit form of its ID may be another file's.
+// The cache is an open-addressing table (linear probing) in a memory-mapped
+// file: opening it costs one mapping, nothing is parsed.
+namespace Fingerprint
+{
+	constexpr const char* CacheFileName = "Fingerprints.bin";
+	constexpr uint32_t CacheMagic = 0x31505246;
+	constexpr uint32_t CacheVersion = 1;
+	constexpr uint64_t InitialCapacity = 4096;
+	constexpr uint64_t MaxLoadPercent = 70;
+	// Every CompactionInterval sessions the table is rebuilt without the entries
+	// nobody looked up during the last MaxIdleSessions sessions (deleted or replaced files).
+	constexpr uint32_t CompactionInterval = 16;
+	constexpr uint32_t MaxIdleSessions = 32;
+
+	struct Key
+	{
+		uint64_t volume = 0;
+		uint64_t file_id = 0;
+		uint64_t size = 0;
+		uint64_t mtime = 0;
+		// Unset when file_id is only part of the file's 128-bit ID.
+		bool unique_id = true;
+	};
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t capacity;
+		uint64_t count;
+		uint32_t session;
+		uint32_t reserved;
+	};
+
+	struct Slot
+	{
+		uint64_t volume;
+		uint64_t file_id;
+		uint64_t size;
+		uint64_t mtime;
+		uint64_t hash;
+		uint32_t session;
+		uint32_t used;
+	};
+
+	// Reads the identity of path without opening its content.
+	std::optional<Key> KeyOf(const fs::path& path)
+	{
+		CopyBackend::FileHandle file(CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr));
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!file.IsValid() || !GetFileInformationByHandle(file.Get(), &info))
+		{
+			return std::nullopt;
+		}
+
+		Key key;
+		key.volume = info.dwVolumeSerialNumber;
+		key.file_id = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+		// Volumes that do not know FileIdInfo only have 64-bit IDs.
+		FILE_ID_INFO id_info;
+		if (GetFileInformationByHandleEx(file.Get(), FileIdInfo, &id_info, sizeof(id_info)))
+		{
+			uint64_t high = 0;
+			std::memcpy(&key.file_id, id_info.FileId.Identifier, sizeof(key.file_id));
+			std::memcpy(&high, id_info.FileId.Identifier + sizeof(key.file_id), sizeof(high));
+			key.unique_id = high == 0;
+		}
+		key.size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		key.mtime = (static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+		return key;
+	}
+
+	class Cache
+	{
+	public:
+		Cache() = default;
+		~Cache()
+		{
+			Close();
+		}
+
+		Cache(const Cache&) = delete;
+		Cache& operator=(const Cache&) = delete;
+
+		// Maps the cache file, starting over with an empty table when it is missing,
+		// from another version or was left half rebuilt. Returns false when the file
+		// cannot be opened, in which case lookups miss and stores are ignored.
+		bool Open(const fs::path& cache_path)
+		{
+			std::lock_guard lock(mutex);
+			path = cache_path;
+			file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+			{
+				return false;
+			}
+
+			LARGE_INTEGER file_size{};
+			GetFileSizeEx(file, &file_size);
+			bool valid = false;
+			if (static_cast<uint64_t>(file_size.QuadPart) > sizeof(Header) && Map((file_size.QuadPart - sizeof(Header)) / sizeof(Slot)))
+			{
+				uint64_t capacity = header->capacity;
+				valid = header->magic == CacheMagic && header->version == CacheVersion
+					&& capacity != 0 && (capacity & (capacity - 1)) == 0
+					&& static_cast<uint64_t>(file_size.QuadPart) == MappedBytes(capacity);
+			}
+			if (!valid && !Reset(InitialCapacity))
+			{
+				CloseFile();
+				return false;
+			}
+
+			header->session++;
+			if (header->session % CompactionInterval == 0 && !Rebuild(header->capacity, header->session > MaxIdleSessions ? header->session - MaxIdleSessions : 0))
+			{
+				CloseFile();
+				return false;
+			}
+			return true;
+		}
+
+		void Close()
+		{
+			std::lock_guard lock(mutex);
+			CloseFile();
+		}
+
+		std::optional<uint64_t> Lookup(const Key& key)
+		{
+			std::lock_guard lock(mutex);
+			if (!header)
+			{
+				return std::nullopt;
+			}
+
+			Slot& slot = Find(key);
+			if (!slot.used || slot.size != key.size || slot.mtime != key.mtime)
+			{
+				return std::nullopt;
+			}
+			slot.session = header->session;
+			return slot.hash;
+		}
+
+		void Store(const Key& key, uint64_t hash)
+		{
+			std::lock_guard lock(mutex);
+			if (!header)
+			{
+				return;
+			}
+
+			if ((header->count + 1) * 100 > header->capacity * MaxLoadPercent && !Rebuild(header->capacity * 2, 0))
+			{
+				return;
+			}
+
+			Slot& slot = Find(key);
+			if (!slot.used)
+			{
+				slot.used = 1;
+				header->count++;
+			}
+			slot.volume = key.volume;
+			slot.file_id = key.file_id;
+			slot.size = key.size;
+			slot.mtime = key.mtime;
+			slot.hash = hash;
+			slot.session = header->session;
+		}
+
+		size_t Count()
+		{
+			std::lock_guard lock(mutex);
+			return header ? static_cast<size_t>(header->count) : 0;
+		}
+
+	private:
+		static uint64_t MappedBytes(uint64_t capacity)
+		{
+			return sizeof(Header) + capacity * sizeof(Slot);
+		}
+
+		// The slot holding the file identified by key, or the empty slot where it belongs.
+		Slot& Find(const Key& key)
+		{
+			uint64_t mask = header->capacity - 1;
+			uint64_t mixed = (key.file_id ^ (key.volume * Hash::Prime64_2)) * Hash::Prime64_1;
+			for (uint64_t i = (mixed ^ (mixed >> 29)) & mask;; i = (i + 1) & mask)
+			{
+				Slot& slot = slots[i];
+				if (!slot.used || (slot.volume == key.volume && slot.file_id == key.file_id))
+				{
+					return slot;
+				}
+			}
+		}
+
+		// Maps the first MappedBytes(capacity) bytes of the file, growing it if needed.
+		bool Map(uint64_t capacity)
+		{
+			uint64_t bytes = MappedBytes(capacity);
+			mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(bytes >> 32), static_cast<DWORD>(bytes), nullptr);
+			if (!mapping)
+			{
+				return false;
+			}
+
+			void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(bytes));
+			if (!view)
+			{
+				CloseHandle(mapping);
+				mapping = nullptr;
+				return false;
+			}
+			header = static_cast<Header*>(view);
+			slots = reinterpret_cast<Slot*>(header + 1);
+			return true;
+		}
+
+		void CloseFile()
+		{
+			Unmap();
+			if (file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(file);
+				file = INVALID_HANDLE_VALUE;
+			}
+		}
+
+		void Unmap()
+		{
+			if (header)
+			{
+				UnmapViewOfFile(header);
+				header = nullptr;
+				slots = nullptr;
+			}
+			if (mapping)
+			{
+				CloseHandle(mapping);
+				mapping = nullptr;
+			}
+		}
+
+		// Truncates the file and maps an empty table of capacity slots.
+		// The magic is written last, so a crash in between leaves a file Open discards.
+		bool Reset(uint64_t capacity)
+		{
+			Unmap();
+			LARGE_INTEGER zero{};
+			if (!SetFilePointerEx(file, zero, nullptr, FILE_BEGIN) || !SetEndOfFile(file) || !Map(capacity))
+			{
+				return false;
+			}
+
+			header->version = CacheVersion;
+			header->capacity = capacity;
+			header->count = 0;
+			header->magic = CacheMagic;
+			return true;
+		}
+
+		// Rehashes the entries used since min_session into a table of capacity slots.
+		bool Rebuild(uint64_t capacity, uint32_t min_session)
+		{
+			std::vector<Slot> kept;
+			kept.reserve(static_cast<size_t>(header->count));
+			for (uint64_t i = 0; i < header->capacity; i++)
+			{
+				if (slots[i].used && slots[i].session >= min_session)
+				{
+					kept.push_back(slots[i]);
+				}
+			}
+
+			uint32_t session = header->session;
+			// Shrink only well below the growth threshold, so a table that just doubled stays doubled.
+			while (capacity > InitialCapacity && kept.size() * 100 * 4 < capacity * MaxLoadPercent)
+			{
+				capacity /= 2;
+			}
+			if (!Reset(capacity))
+			{
+				return false;
+			}
+
+			header->session = session;
+			for (const auto& entry : kept)
+			{
+				Slot& slot = Find({ entry.volume, entry.file_id, entry.size, entry.mtime });
+				slot = entry;
+				header->count++;
+			}
+			return true;
+		}
+
+		fs::path path;
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+		Header* header = nullptr;
+		Slot* slots = nullptr;
+		std::mutex mutex;
+	};
+
+	Cache GlobalCache;
+
+	// The key path is cached under, unless its file ID cannot tell it apart from other files.
+	std::optional<Key> CacheKeyOf(const fs::path& path)
+	{
+		std::optional<Key> key = KeyOf(path);
+		if (key && !key->unique_id)
+		{
+			return std::nullopt;
+		}
+		return key;
+	}
+
+	// The cached hash of path, if the file has not changed since it was stored.
+	std::optional<uint64_t> CachedHash(const fs::path& path)
+	{
+		std::optional<Key> key = CacheKeyOf(path);
+		return key ? GlobalCache.Lookup(*key) : std::nullopt;
+	}
+
+	// Records a hash computed elsewhere, for instance while the file was copied.
+	void Remember(const fs::path& path, uint64_t hash)
+	{
+		if (std::optional<Key> key = CacheKeyOf(path))
+		{
+			GlobalCache.Store(*key, hash);
+		}
+	}
+
+	// Content hash of path, read from the cache while the file is unchanged.
+	// With trust_cache unset the file is always read, and its entry refreshed.
+	uint64_t HashFile(const fs::path& path, bool trust_cache = true)
+	{
+		std::optional<Key> key = CacheKeyOf(path);
+		if (key && trust_cache)
+		{
+			if (std::optional<uint64_t> cached = GlobalCache.Lookup(*key))
+			{
+				return *cached;
+			}
+		}
+
+		uint64_t hash = Hash::HashFile(path);
+		if (key)
+		{
+			GlobalCache.Store(*key, hash);
+		}
+		return hash;
+	}
+}
@@ -0,0 +1,276 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "BlobStore.h"
+#include "Fingerprint.h"
+#include "Hash.h"
+#include "Scanner.h"
+
+namespace fs = std::filesystem;
+
+// Last known state of the live Mods folder, in the spirit of git's index.
+// The file holds one fixed-size record per file (size, mtime, file ID, hash),
+// sorted by name, followed by the names, and the profile last loaded into or
+// captured from the folder. It is memory-mapped, so reading it costs nothing,
+// and a refresh only lists the folder: a file whose size, mtime and file ID
+// are unchanged keeps its recorded hash, so no content is read to tell what
+// changed since that profile.
+namespace FolderIndex
+{
+	constexpr const char* IndexFileName = "Mods.index";
+	constexpr uint32_t IndexMagic = 0x5844494D;
+	constexpr uint32_t IndexVersion = 1;
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t count;
+		uint64_t names_size;
+		uint64_t volume;
+		uint32_t profile_length;
+		uint32_t reserved;
+		// Hash of everything after the header.
+		uint64_t checksum;
+	};
+
+	struct Record
+	{
+		uint64_t size;
+		int64_t mtime;
+		uint64_t file_id;
+		// 0 when unknown.
+		uint64_t hash;
+		uint32_t name_offset;
+		uint32_t name_length;
+	};
+
+	struct Entry
+	{
+		std::string name;
+		uintmax_t size = 0;
+		int64_t mtime = 0;
+		uint64_t file_id = 0;
+		uint64_t hash = 0;
+	};
+
+	class Index
+	{
+	public:
+		Index() = default;
+		~Index()
+		{
+			Close();
+		}
+
+		Index(const Index&) = delete;
+		Index& operator=(const Index&) = delete;
+
+		// Maps the index file. A missing, foreign or damaged file reads as an empty index.
+		bool Open(const fs::path& index_path)
+		{
+			Close();
+			path = index_path;
+			file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			LARGE_INTEGER file_size{};
+			if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size) || static_cast<uint64_t>(file_size.QuadPart) < sizeof(Header))
+			{
+				Close();
+				return false;
+			}
+
+			mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (!view)
+			{
+				Close();
+				return false;
+			}
+
+			header = static_cast<const Header*>(view);
+			records = reinterpret_cast<const Record*>(header + 1);
+			uint64_t body_size = static_cast<uint64_t>(file_size.QuadPart) - sizeof(Header);
+			bool valid = header->magic == IndexMagic && header->version == IndexVersion
+				&& header->count <= body_size / sizeof(Record)
+				&& header->count * sizeof(Record) + header->names_size == body_size
+				&& header->profile_length <= header->names_size
+				&& Checksum(records, static_cast<size_t>(body_size)) == header->checksum;
+			if (!valid)
+			{
+				Close();
+				return false;
+			}
+			names = reinterpret_cast<const char*>(records + header->count);
+			return true;
+		}
+
+		void Close()
+		{
+			if (view)
+			{
+				UnmapViewOfFile(view);
+				view = nullptr;
+			}
+			if (mapping)
+			{
+				CloseHandle(mapping);
+				mapping = nullptr;
+			}
+			if (file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(file);
+				file = INVALID_HANDLE_VALUE;
+			}
+			header = nullptr;
+			records = nullptr;
+			names = nullptr;
+		}
+
+		size_t Count() const
+		{
+			return header ? static_cast<size_t>(header->count) : 0;
+		}
+
+		const Record& At(size_t index) const
+		{
+			return records[index];
+		}
+
+		std::string_view Name(const Record& record) const
+		{
+			return std::string_view(names + record.name_offset, record.name_length);
+		}
+
+		// The profile last loaded into or captured from the folder, empty if unknown.
+		std::string_view Profile() const
+		{
+			return header ? std::string_view(names, header->profile_length) : std::string_view();
+		}
+
+		uint64_t Volume() const
+		{
+			return header ? header->volume : 0;
+		}
+
+		const Record* Find(std::string_view name) const
+		{
+			const Record* end = records + Count();
+			const Record* it = std::lower_bound(records, end, name, [&](const Record& record, std::string_view value) { return Name(record) < value; });
+			return it != end && Name(*it) == name ? it : nullptr;
+		}
+
+		// Replaces the index file with entries, which must be sorted by name, and maps it again.
+		// The file is written beside the old one and renamed over it, so a crash keeps one of the two.
+		bool Save(uint64_t volume, std::string_view profile, const std::vector<Entry>& entries)
+		{
+			std::string body(entries.size() * sizeof(Record), '\0');
+			body.append(profile);
+			for (size_t i = 0; i < entries.size(); i++)
+			{
+				Record record{ entries[i].size, entries[i].mtime, entries[i].file_id, entries[i].hash,
+					static_cast<uint32_t>(body.size() - entries.size() * sizeof(Record)), static_cast<uint32_t>(entries[i].name.size()) };
+				std::memcpy(body.data() + i * sizeof(Record), &record, sizeof(Record));
+				body.append(entries[i].name);
+			}
+
+			Header new_header{ IndexMagic, IndexVersion, entries.size(), body.size() - entries.size() * sizeof(Record), volume, static_cast<uint32_t>(profile.size()), 0, Checksum(body.data(), body.size()) };
+			fs::path temp = path;
+			temp += ".tmp";
+			{
+				std::ofstream output(temp, std::ios::binary | std::ios::trunc);
+				output.write(reinterpret_cast<const char*>(&new_header), sizeof(new_header));
+				output.write(body.data(), static_cast<std::streamsize>(body.size()));
+				if (!output)
+				{
+					return false;
+				}
+			}
+
+			fs::path index_path = path;
+			Close();
+			std::error_code ec;
+			fs::rename(temp, index_path, ec);
+			Open(index_path);
+			return !ec;
+		}
+
+	private:
+		static uint64_t Checksum(const void* data, size_t length)
+		{
+			Hash::Hasher hasher;
+			hasher.Update(data, length);
+			return hasher.Final();
+		}
+
+		fs::path path;
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+		const void* view = nullptr;
+		const Header* header = nullptr;
+		const Record* records = nullptr;
+		const char* names = nullptr;
+	};
+
+	// Lists folder again. Files unchanged since the index was written keep their
+	// recorded hash; the others take it from known (the manifest just loaded into
+	// or captured from the folder) when their size and mtime match, then from the
+	// fingerprint cache, and are left at 0 otherwise. No file content is read.
+	std::vector<Entry> Refresh(const Index& index, const fs::path& folder, const BlobStore::Manifest* known, uint64_t& volume)
+	{
+		std::map<std::string_view, const BlobStore::ManifestEntry*> manifest;
+		if (known)
+		{
+			for (const auto& entry : *known)
+			{
+				manifest[entry.name] = &entry;
+			}
+		}
+
+		Scanner::Result scan = Scanner::Scan(folder);
+		volume = scan.volume;
+		std::vector<Entry> entries;
+		entries.reserve(scan.files.size());
+		for (auto& file : scan.files)
+		{
+			Entry entry{ .size = file.size, .mtime = file.mtime, .file_id = file.file_id };
+			const Record* record = index.Volume() == scan.volume ? index.Find(file.name) : nullptr;
+			auto it = manifest.find(file.name);
+			if (record && record->hash && record->size == file.size && record->mtime == file.mtime && record->file_id == file.file_id)
+			{
+				entry.hash = record->hash;
+			}
+			else if (it != manifest.end() && it->second->size == file.size && it->second->mtime == file.mtime && !it->second->hash.empty())
+			{
+				entry.hash = std::stoull(it->second->hash, nullptr, 16);
+			}
+			else if (file.file_id)
+			{
+				entry.hash = Fingerprint::GlobalCache.Lookup({ scan.volume, file.file_id, file.size, static_cast<uint64_t>(file.mtime) }).value_or(0);
+			}
+			entry.name = std::move(file.name);
+			entries.push_back(std::move(entry));
+		}
+		return entries;
+	}
+
+	// The entries as a manifest, for comparison with a profile. Unknown hashes are left empty.
+	BlobStore::Manifest ToManifest(const std::vector<Entry>& entries)
+	{
+		BlobStore::Manifest manifest;
+		manifest.reserve(entries.size());
+		for (const auto& entry : entries)
+		{
+			manifest.push_back({ entry.name, entry.size, entry.mtime, entry.hash ? Hash::ToHex(entry.hash) : std::string() });
+		}
+		return manifest;
+	}
+}
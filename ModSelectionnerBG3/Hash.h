@@ -0,0 +1,438 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HASH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define HASH_NEON 1
+#include <arm_neon.h>
+#endif
+
+// MSVC compiles any intrinsic as is, GCC and Clang need the target named per function.
+#if defined(_MSC_VER) || !defined(HASH_X86)
+#define HASH_TARGET(features)
+#else
+#define HASH_TARGET(features) __attribute__((target(features)))
+#endif
+
+namespace fs = std::filesystem;
+
+// 64-bit content hash used to key mod files.
+// Stripe-accumulate design (8 lanes of 64 bits, 64-byte stripes, 1 KiB blocks)
+// so that each step maps directly onto wide vector registers.
+// The block loop has a scalar version and AVX2, SSE2 and NEON versions that
+// give the same result; the fastest one the CPU supports is picked at startup.
+namespace Hash
+{
+	constexpr size_t StripeSize = 64;
+	constexpr size_t StripesPerBlock = 16;
+	constexpr size_t BlockSize = StripeSize * StripesPerBlock;
+	constexpr size_t Lanes = 8;
+	constexpr size_t SecretWords = StripesPerBlock + Lanes;
+
+	constexpr uint64_t Prime32_1 = 0x9E3779B1ULL;
+	constexpr uint64_t Prime64_1 = 0x9E3779B185EBCA87ULL;
+	constexpr uint64_t Prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+	constexpr uint64_t Prime64_3 = 0x165667B19E3779F9ULL;
+
+	constexpr std::array<uint64_t, SecretWords> MakeSecret()
+	{
+		std::array<uint64_t, SecretWords> secret{};
+		uint64_t state = 0x42473350524F4649ULL;
+		for (auto& word : secret)
+		{
+			state += 0x9E3779B97F4A7C15ULL;
+			uint64_t z = state;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			word = z ^ (z >> 31);
+		}
+		return secret;
+	}
+
+	constexpr std::array<uint64_t, SecretWords> Secret = MakeSecret();
+
+	inline uint64_t Read64(const unsigned char* p)
+	{
+		uint64_t value;
+		std::memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	inline uint64_t Mul128Fold64(uint64_t lhs, uint64_t rhs)
+	{
+		uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+		uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+		uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+		uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+		uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+		uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+		uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+		return lower ^ upper;
+	}
+
+	inline uint64_t Avalanche(uint64_t h)
+	{
+		h ^= h >> 37;
+		h *= 0x165667919E3779F9ULL;
+		h ^= h >> 32;
+		return h;
+	}
+
+	void AccumulateStripe(uint64_t* acc, const unsigned char* input, const uint64_t* key)
+	{
+		for (size_t i = 0; i < Lanes; i++)
+		{
+			uint64_t data = Read64(input + i * 8);
+			uint64_t data_key = data ^ key[i];
+			acc[i ^ 1] += data;
+			acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+		}
+	}
+
+	void ScrambleAccumulators(uint64_t* acc, const uint64_t* key)
+	{
+		for (size_t i = 0; i < Lanes; i++)
+		{
+			uint64_t value = acc[i];
+			value ^= value >> 47;
+			value ^= key[i];
+			acc[i] = value * Prime32_1;
+		}
+	}
+
+	void AccumulateBlocksScalar(uint64_t* acc, const unsigned char* input, size_t block_count)
+	{
+		for (size_t block = 0; block < block_count; block++)
+		{
+			const unsigned char* data = input + block * BlockSize;
+			for (size_t stripe = 0; stripe < StripesPerBlock; stripe++)
+			{
+				AccumulateStripe(acc, data + stripe * StripeSize, Secret.data() + stripe);
+			}
+			ScrambleAccumulators(acc, Secret.data() + StripesPerBlock);
+		}
+	}
+
+#ifdef HASH_X86
+	// acc[i ^ 1] += data[i] swaps the two 64-bit lanes of each 128-bit lane
+	// (_MM_SHUFFLE(1, 0, 3, 2) on 32-bit elements), and the 32x32->64 product is
+	// what mul_epu32 computes on every 64-bit lane.
+	HASH_TARGET("avx2")
+	void AccumulateBlocksAvx2(uint64_t* acc, const unsigned char* input, size_t block_count)
+	{
+		__m256i state[2] = { _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + 4)) };
+		const __m256i prime = _mm256_set1_epi32(static_cast<int>(Prime32_1));
+		for (size_t block = 0; block < block_count; block++)
+		{
+			const unsigned char* data = input + block * BlockSize;
+			for (size_t stripe = 0; stripe < StripesPerBlock; stripe++)
+			{
+				const unsigned char* stripe_data = data + stripe * StripeSize;
+				const uint64_t* key = Secret.data() + stripe;
+				for (size_t half = 0; half < 2; half++)
+				{
+					__m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(stripe_data) + half);
+					__m256i value_key = _mm256_xor_si256(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key + half * 4)));
+					__m256i product = _mm256_mul_epu32(value_key, _mm256_srli_epi64(value_key, 32));
+					__m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+					state[half] = _mm256_add_epi64(state[half], _mm256_add_epi64(swapped, product));
+				}
+			}
+
+			const uint64_t* key = Secret.data() + StripesPerBlock;
+			for (size_t half = 0; half < 2; half++)
+			{
+				__m256i value = _mm256_xor_si256(state[half], _mm256_srli_epi64(state[half], 47));
+				value = _mm256_xor_si256(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key + half * 4)));
+				__m256i low = _mm256_mul_epu32(value, prime);
+				__m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+				state[half] = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+			}
+		}
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc), state[0]);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + 4), state[1]);
+	}
+
+	// SSE2 is all the 128-bit version needs, and every x64 CPU has it.
+	HASH_TARGET("sse2")
+	void AccumulateBlocksSse2(uint64_t* acc, const unsigned char* input, size_t block_count)
+	{
+		__m128i state[4];
+		for (size_t quarter = 0; quarter < 4; quarter++)
+		{
+			state[quarter] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + quarter);
+		}
+		const __m128i prime = _mm_set1_epi32(static_cast<int>(Prime32_1));
+		for (size_t block = 0; block < block_count; block++)
+		{
+			const unsigned char* data = input + block * BlockSize;
+			for (size_t stripe = 0; stripe < StripesPerBlock; stripe++)
+			{
+				const unsigned char* stripe_data = data + stripe * StripeSize;
+				const uint64_t* key = Secret.data() + stripe;
+				for (size_t quarter = 0; quarter < 4; quarter++)
+				{
+					__m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe_data) + quarter);
+					__m128i value_key = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + quarter * 2)));
+					__m128i product = _mm_mul_epu32(value_key, _mm_srli_epi64(value_key, 32));
+					__m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+					state[quarter] = _mm_add_epi64(state[quarter], _mm_add_epi64(swapped, product));
+				}
+			}
+
+			const uint64_t* key = Secret.data() + StripesPerBlock;
+			for (size_t quarter = 0; quarter < 4; quarter++)
+			{
+				__m128i value = _mm_xor_si128(state[quarter], _mm_srli_epi64(state[quarter], 47));
+				value = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + quarter * 2)));
+				__m128i low = _mm_mul_epu32(value, prime);
+				__m128i high = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+				state[quarter] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+			}
+		}
+		for (size_t quarter = 0; quarter < 4; quarter++)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + quarter, state[quarter]);
+		}
+	}
+
+	void CpuId(int registers[4], int leaf, int subleaf)
+	{
+#ifdef _MSC_VER
+		__cpuidex(registers, leaf, subleaf);
+#else
+		unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+		__cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+		registers[0] = static_cast<int>(eax);
+		registers[1] = static_cast<int>(ebx);
+		registers[2] = static_cast<int>(ecx);
+		registers[3] = static_cast<int>(edx);
+#endif
+	}
+
+	// AVX2 needs the CPU feature and an OS that saves the YMM registers.
+	bool HasAvx2()
+	{
+		int registers[4] = {};
+		CpuId(registers, 0, 0);
+		if (registers[0] < 7)
+		{
+			return false;
+		}
+
+		CpuId(registers, 1, 0);
+		bool os_saves_ymm = (registers[2] & (1 << 27)) && (registers[2] & (1 << 28));
+		if (!os_saves_ymm)
+		{
+			return false;
+		}
+#ifdef _MSC_VER
+		unsigned long long xcr0 = _xgetbv(0);
+#else
+		unsigned int xcr0_low = 0, xcr0_high = 0;
+		__asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+		unsigned long long xcr0 = (static_cast<unsigned long long>(xcr0_high) << 32) | xcr0_low;
+#endif
+		if ((xcr0 & 6) != 6)
+		{
+			return false;
+		}
+
+		CpuId(registers, 7, 0);
+		return (registers[1] & (1 << 5)) != 0;
+	}
+#endif
+
+#ifdef HASH_NEON
+	void AccumulateBlocksNeon(uint64_t* acc, const unsigned char* input, size_t block_count)
+	{
+		uint64x2_t state[4];
+		for (size_t quarter = 0; quarter < 4; quarter++)
+		{
+			state[quarter] = vld1q_u64(acc + quarter * 2);
+		}
+		const uint32x2_t prime = vdup_n_u32(static_cast<uint32_t>(Prime32_1));
+		for (size_t block = 0; block < block_count; block++)
+		{
+			const unsigned char* data = input + block * BlockSize;
+			for (size_t stripe = 0; stripe < StripesPerBlock; stripe++)
+			{
+				const unsigned char* stripe_data = data + stripe * StripeSize;
+				const uint64_t* key = Secret.data() + stripe;
+				for (size_t quarter = 0; quarter < 4; quarter++)
+				{
+					uint64x2_t value = vreinterpretq_u64_u8(vld1q_u8(stripe_data + quarter * 16));
+					uint64x2_t value_key = veorq_u64(value, vld1q_u64(key + quarter * 2));
+					uint64x2_t product = vmull_u32(vmovn_u64(value_key), vshrn_n_u64(value_key, 32));
+					uint64x2_t swapped = vextq_u64(value, value, 1);
+					state[quarter] = vaddq_u64(state[quarter], vaddq_u64(swapped, product));
+				}
+			}
+
+			const uint64_t* key = Secret.data() + StripesPerBlock;
+			for (size_t quarter = 0; quarter < 4; quarter++)
+			{
+				uint64x2_t value = veorq_u64(state[quarter], vshrq_n_u64(state[quarter], 47));
+				value = veorq_u64(value, vld1q_u64(key + quarter * 2));
+				uint64x2_t high = vshlq_n_u64(vmull_u32(vshrn_n_u64(value, 32), prime), 32);
+				state[quarter] = vmlal_u32(high, vmovn_u64(value), prime);
+			}
+		}
+		for (size_t quarter = 0; quarter < 4; quarter++)
+		{
+			vst1q_u64(acc + quarter * 2, state[quarter]);
+		}
+	}
+#endif
+
+	using BlockKernel = void (*)(uint64_t* acc, const unsigned char* input, size_t block_count);
+
+	struct Kernel
+	{
+		const char* name;
+		BlockKernel accumulate;
+	};
+
+	// Every kernel this CPU can run, fastest first. The scalar one is always last.
+	std::vector<Kernel> AvailableKernels()
+	{
+		std::vector<Kernel> kernels;
+#ifdef HASH_X86
+		if (HasAvx2())
+		{
+			kernels.push_back({ "avx2", AccumulateBlocksAvx2 });
+		}
+		kernels.push_back({ "sse2", AccumulateBlocksSse2 });
+#endif
+#ifdef HASH_NEON
+		kernels.push_back({ "neon", AccumulateBlocksNeon });
+#endif
+		kernels.push_back({ "scalar", AccumulateBlocksScalar });
+		return kernels;
+	}
+
+	const Kernel& BestKernel()
+	{
+		static const Kernel best = AvailableKernels().front();
+		return best;
+	}
+
+	void AccumulateBlocks(uint64_t* acc, const unsigned char* input, size_t block_count)
+	{
+		BestKernel().accumulate(acc, input, block_count);
+	}
+
+	class Hasher
+	{
+	public:
+		Hasher() : kernel(BestKernel().accumulate) {}
+		explicit Hasher(BlockKernel kernel) : kernel(kernel) {}
+
+		void Update(const void* data, size_t length)
+		{
+			const unsigned char* input = static_cast<const unsigned char*>(data);
+			total_length += length;
+
+			if (buffered > 0)
+			{
+				size_t take = std::min(length, BlockSize - buffered);
+				std::memcpy(buffer.data() + buffered, input, take);
+				buffered += take;
+				input += take;
+				length -= take;
+				if (buffered < BlockSize)
+				{
+					return;
+				}
+				kernel(acc.data(), buffer.data(), 1);
+				buffered = 0;
+			}
+
+			size_t block_count = length / BlockSize;
+			kernel(acc.data(), input, block_count);
+			input += block_count * BlockSize;
+			length -= block_count * BlockSize;
+
+			std::memcpy(buffer.data(), input, length);
+			buffered = length;
+		}
+
+		uint64_t Final() const
+		{
+			std::array<uint64_t, Lanes> state = acc;
+			size_t full_stripes = buffered / StripeSize;
+			for (size_t stripe = 0; stripe < full_stripes; stripe++)
+			{
+				AccumulateStripe(state.data(), buffer.data() + stripe * StripeSize, Secret.data() + stripe);
+			}
+
+			size_t tail = buffered % StripeSize;
+			if (tail > 0)
+			{
+				unsigned char last[StripeSize] = {};
+				std::memcpy(last, buffer.data() + full_stripes * StripeSize, tail);
+				AccumulateStripe(state.data(), last, Secret.data() + full_stripes);
+			}
+
+			uint64_t result = total_length * Prime64_1;
+			for (size_t i = 0; i < Lanes; i += 2)
+			{
+				result += Mul128Fold64(state[i] ^ Secret[i], state[i + 1] ^ Secret[i + 1]);
+			}
+			return Avalanche(result);
+		}
+
+	private:
+		BlockKernel kernel;
+		std::array<uint64_t, Lanes> acc = { Prime32_1, Prime64_1, Prime64_2, Prime64_3, Prime64_1 ^ Prime64_2, Prime64_2 ^ Prime64_3, Prime64_3 ^ Prime32_1, Prime64_1 ^ Prime32_1 };
+		std::array<unsigned char, BlockSize> buffer{};
+		size_t buffered = 0;
+		uint64_t total_length = 0;
+	};
+
+	std::string ToHex(uint64_t value)
+	{
+		static constexpr char Digits[] = "0123456789abcdef";
+		std::string hex(16, '0');
+		for (int i = 15; i >= 0; i--)
+		{
+			hex[i] = Digits[value & 0xF];
+			value >>= 4;
+		}
+		return hex;
+	}
+
+	uint64_t HashFile(const fs::path& path)
+	{
+		constexpr size_t ReadSize = 1 << 20;
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+		{
+			throw std::runtime_error("Cannot open " + path.string() + " for hashing");
+		}
+
+		std::vector<char> chunk(ReadSize);
+		Hasher hasher;
+		while (file)
+		{
+			file.read(chunk.data(), chunk.size());
+			hasher.Update(chunk.data(), static_cast<size_t>(file.gcount()));
+		}
+		return hasher.Final();
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include "JSON/json.hpp"
+
+namespace fs = std::filesystem;
+
+// Profile usage history, used to guess which profile will be loaded next.
+namespace History
+{
+	constexpr const char* HistoryFileName = "History.ini";
+
+	struct Usage
+	{
+		std::string name;
+		int64_t last_used = 0;
+		uint64_t uses = 0;
+	};
+
+	struct Data
+	{
+		std::vector<Usage> profiles;
+		uint64_t predictions = 0;
+		uint64_t hits = 0;
+		double seconds_saved = 0.0;
+	};
+
+	NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(Usage, name, last_used, uses)
+	NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(Data, profiles, predictions, hits, seconds_saved)
+
+	Data Load(const fs::path& path)
+	{
+		Data data;
+		if (!fs::exists(path))
+		{
+			return data;
+		}
+
+		try
+		{
+			std::ifstream file(path);
+			nlohmann::json parser;
+			file >> parser;
+			data = parser.get<Data>();
+		}
+		catch (const nlohmann::json::exception& e)
+		{
+			std::cerr << "Erreur: " << e.what() << std::endl;
+		}
+		return data;
+	}
+
+	void Save(const fs::path& path, const Data& data)
+	{
+		std::ofstream file(path);
+		file << nlohmann::json(data).dump(4);
+	}
+
+	void RecordUse(Data& data, const std::string& name)
+	{
+		int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		auto it = std::find_if(data.profiles.begin(), data.profiles.end(), [&](const Usage& usage) { return usage.name == name; });
+		if (it == data.profiles.end())
+		{
+			data.profiles.push_back({ .name = name });
+			it = data.profiles.end() - 1;
+		}
+		it->last_used = now;
+		it->uses++;
+	}
+
+	// The last used profile is most likely the one already in the Mods folder,
+	// so the guess is the most used of the others, the most recent on ties.
+	std::string Predict(const Data& data, const std::vector<std::string>& existing)
+	{
+		const Usage* last = nullptr;
+		for (const auto& usage : data.profiles)
+		{
+			if (!last || usage.last_used > last->last_used)
+			{
+				last = &usage;
+			}
+		}
+
+		const Usage* best = nullptr;
+		for (const auto& usage : data.profiles)
+		{
+			if (&usage == last || std::find(existing.begin(), existing.end(), usage.name) == existing.end())
+			{
+				continue;
+			}
+			if (!best || usage.uses > best->uses || (usage.uses == best->uses && usage.last_used > best->last_used))
+			{
+				best = &usage;
+			}
+		}
+		return best ? best->name : std::string();
+	}
+}
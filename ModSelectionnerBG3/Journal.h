@@ -0,0 +1,280 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "CopyBackend.h"
+#include "CopyEngine.h"
+
+namespace fs = std::filesystem;
+
+// Write-ahead journal for profile activation and capture.
+// The planned file operations are written and flushed before any of them runs,
+// then each one is marked done as it completes. Done marks are flushed in
+// batches: a crash can only make a few finished operations run again, and
+// every operation is safe to repeat.
+// One line per record, tab separated:
+//   B <kind> <subject>                              transaction start
+//   P <id> <op> <tier> <size> <source> <destination> planned operation
+//   D <id>                                          operation done
+//   C                                               transaction committed
+namespace Journal
+{
+	constexpr const char* JournalFileName = "Switch.journal";
+	constexpr size_t DoneBatchSize = 64;
+	constexpr auto DoneBatchDelay = std::chrono::milliseconds(250);
+
+	enum class OpKind
+	{
+		Copy,
+		Remove,
+		Rename,
+		Swap,
+	};
+
+	struct Op
+	{
+		uint64_t id = 0;
+		OpKind kind = OpKind::Copy;
+		CopyBackend::Tier tier = CopyBackend::Tier::Link;
+		uintmax_t size = 0;
+		fs::path source;
+		fs::path destination;
+	};
+
+	// Paths are written in UTF-8, so that names outside the code page survive replay.
+	std::string ToUtf8(const fs::path& path)
+	{
+		std::u8string text = path.u8string();
+		return std::string(text.begin(), text.end());
+	}
+
+	fs::path FromUtf8(const std::string& text)
+	{
+		return fs::path(std::u8string(text.begin(), text.end()));
+	}
+
+	struct Pending
+	{
+		std::string kind;
+		std::string subject;
+		std::vector<Op> ops;
+	};
+
+	class Writer
+	{
+	public:
+		Writer(const fs::path& path, const std::string& kind, const std::string& subject)
+			: path(path), file(CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr))
+		{
+			buffer << "B\t" << kind << "\t" << subject << "\n";
+		}
+
+		~Writer()
+		{
+			Flush();
+		}
+
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		uint64_t Add(OpKind kind, const fs::path& source, const fs::path& destination, uintmax_t size = 0, CopyBackend::Tier tier = CopyBackend::Tier::Link)
+		{
+			std::lock_guard lock(mutex);
+			uint64_t id = ++last_id;
+			buffer << "P\t" << id << "\t" << static_cast<int>(kind) << "\t" << static_cast<int>(tier) << "\t" << size
+				<< "\t" << ToUtf8(source) << "\t" << ToUtf8(destination) << "\n";
+			return id;
+		}
+
+		void Done(uint64_t id)
+		{
+			std::lock_guard lock(mutex);
+			buffer << "D\t" << id << "\n";
+			if (++unflushed_done >= DoneBatchSize || std::chrono::steady_clock::now() - last_flush >= DoneBatchDelay)
+			{
+				FlushLocked();
+			}
+		}
+
+		// Makes everything recorded so far durable. Called once the plan is written,
+		// before the first operation runs.
+		void Flush()
+		{
+			std::lock_guard lock(mutex);
+			FlushLocked();
+		}
+
+		// The transaction finished: the journal is no longer needed.
+		void Commit()
+		{
+			{
+				std::lock_guard lock(mutex);
+				buffer << "C\n";
+				FlushLocked();
+			}
+			file.Close();
+			std::error_code ec;
+			fs::remove(path, ec);
+		}
+
+		std::function<void(const CopyEngine::Job&)> DoneCallback()
+		{
+			return [this](const CopyEngine::Job& job) { Done(job.journal_id); };
+		}
+
+	private:
+		void FlushLocked()
+		{
+			std::string data = buffer.str();
+			buffer.str({});
+			unflushed_done = 0;
+			last_flush = std::chrono::steady_clock::now();
+			if (data.empty() || !file.IsValid())
+			{
+				return;
+			}
+
+			DWORD written = 0;
+			WriteFile(file.Get(), data.data(), static_cast<DWORD>(data.size()), &written, nullptr);
+			FlushFileBuffers(file.Get());
+		}
+
+		fs::path path;
+		CopyBackend::FileHandle file;
+		std::mutex mutex;
+		std::ostringstream buffer;
+		uint64_t last_id = 0;
+		size_t unflushed_done = 0;
+		std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+	};
+
+	std::vector<std::string> SplitFields(const std::string& line)
+	{
+		std::vector<std::string> fields;
+		std::stringstream ss(line);
+		std::string field;
+		while (std::getline(ss, field, '\t'))
+		{
+			fields.push_back(field);
+		}
+		return fields;
+	}
+
+	// Returns the operations of an unfinished transaction, if the last run left one.
+	// Records end with a newline: a last line without one was torn by the crash
+	// and is ignored, even when it has all its fields.
+	std::optional<Pending> Load(const fs::path& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			return std::nullopt;
+		}
+
+		Pending pending;
+		std::vector<Op> planned;
+		std::vector<uint64_t> done;
+		bool committed = false;
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (file.eof())
+			{
+				break;
+			}
+			std::vector<std::string> fields = SplitFields(line);
+			try
+			{
+				if (fields.size() == 3 && fields[0] == "B")
+				{
+					pending.kind = fields[1];
+					pending.subject = fields[2];
+				}
+				else if (fields.size() == 7 && fields[0] == "P")
+				{
+					planned.push_back({ std::stoull(fields[1]), static_cast<OpKind>(std::stoi(fields[2])), static_cast<CopyBackend::Tier>(std::stoi(fields[3])), std::stoull(fields[4]), FromUtf8(fields[5]), FromUtf8(fields[6]) });
+				}
+				else if (fields.size() == 2 && fields[0] == "D")
+				{
+					done.push_back(std::stoull(fields[1]));
+				}
+				else if (fields.size() == 1 && fields[0] == "C")
+				{
+					committed = true;
+				}
+			}
+			catch (const std::exception&)
+			{
+				continue;
+			}
+		}
+
+		if (committed || pending.kind.empty())
+		{
+			return std::nullopt;
+		}
+
+		std::sort(done.begin(), done.end());
+		for (auto& op : planned)
+		{
+			if (!std::binary_search(done.begin(), done.end(), op.id))
+			{
+				pending.ops.push_back(std::move(op));
+			}
+		}
+		return pending;
+	}
+
+	// Runs again the unfinished copy, remove and rename operations, in their
+	// planned order by kind. Swap operations are left to the caller.
+	CopyEngine::Report Replay(const Pending& pending, unsigned parallelism)
+	{
+		CopyEngine::Report report;
+		std::error_code ec;
+		for (const auto& op : pending.ops)
+		{
+			if (op.kind == OpKind::Remove)
+			{
+				CopyBackend::RemoveFile(op.source);
+			}
+		}
+
+		std::vector<CopyEngine::Job> jobs;
+		for (const auto& op : pending.ops)
+		{
+			if (op.kind == OpKind::Copy && fs::exists(op.source))
+			{
+				jobs.push_back({ op.source, op.destination, op.size, op.tier });
+			}
+		}
+		if (!jobs.empty())
+		{
+			report = CopyEngine::Run(std::move(jobs), parallelism);
+		}
+
+		for (const auto& op : pending.ops)
+		{
+			if (op.kind == OpKind::Rename && fs::exists(op.source))
+			{
+				fs::rename(op.source, op.destination, ec);
+			}
+		}
+		return report;
+	}
+
+	void Discard(const fs::path& path)
+	{
+		std::error_code ec;
+		fs::remove(path, ec);
+	}
+}
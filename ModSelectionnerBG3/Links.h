@@ -0,0 +1,144 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "CopyBackend.h"
+
+namespace fs = std::filesystem;
+
+// Junctions and symbolic links used by the link activation mode.
+// Junctions need no special privilege on local NTFS volumes, which is why
+// the Mods folder uses one; file symlinks need Developer Mode or admin rights.
+namespace Links
+{
+	// Layout of a mount point REPARSE_DATA_BUFFER (the full struct lives in the DDK headers).
+	struct MountPointReparseBuffer
+	{
+		DWORD ReparseTag;
+		WORD ReparseDataLength;
+		WORD Reserved;
+		WORD SubstituteNameOffset;
+		WORD SubstituteNameLength;
+		WORD PrintNameOffset;
+		WORD PrintNameLength;
+		WCHAR PathBuffer[1];
+	};
+
+	constexpr size_t MountPointHeaderSize = offsetof(MountPointReparseBuffer, PathBuffer);
+	constexpr size_t ReparseHeaderSize = offsetof(MountPointReparseBuffer, SubstituteNameOffset);
+
+	bool IsLink(const fs::path& path)
+	{
+		DWORD attributes = GetFileAttributesW(path.c_str());
+		return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT);
+	}
+
+	// Removes the link itself, never what it points to.
+	std::error_code RemoveLink(const fs::path& path)
+	{
+		DWORD attributes = GetFileAttributesW(path.c_str());
+		BOOL removed = (attributes & FILE_ATTRIBUTE_DIRECTORY) ? RemoveDirectoryW(path.c_str()) : DeleteFileW(path.c_str());
+		return removed ? std::error_code{} : CopyBackend::LastError();
+	}
+
+	std::error_code CreateJunction(const fs::path& link, const fs::path& target)
+	{
+		std::wstring print_name = fs::absolute(target).wstring();
+		std::wstring substitute_name = L"\\??\\" + print_name;
+
+		WORD substitute_bytes = static_cast<WORD>(substitute_name.size() * sizeof(WCHAR));
+		WORD print_bytes = static_cast<WORD>(print_name.size() * sizeof(WCHAR));
+		size_t path_bytes = substitute_bytes + sizeof(WCHAR) + print_bytes + sizeof(WCHAR);
+		if (MountPointHeaderSize + path_bytes > MAXIMUM_REPARSE_DATA_BUFFER_SIZE)
+		{
+			return std::make_error_code(std::errc::filename_too_long);
+		}
+
+		std::vector<char> buffer(MountPointHeaderSize + path_bytes, 0);
+		MountPointReparseBuffer* reparse = reinterpret_cast<MountPointReparseBuffer*>(buffer.data());
+		reparse->ReparseTag = IO_REPARSE_TAG_MOUNT_POINT;
+		reparse->ReparseDataLength = static_cast<WORD>(MountPointHeaderSize - ReparseHeaderSize + path_bytes);
+		reparse->SubstituteNameOffset = 0;
+		reparse->SubstituteNameLength = substitute_bytes;
+		reparse->PrintNameOffset = static_cast<WORD>(substitute_bytes + sizeof(WCHAR));
+		reparse->PrintNameLength = print_bytes;
+		std::memcpy(reparse->PathBuffer, substitute_name.c_str(), substitute_bytes);
+		std::memcpy(reinterpret_cast<char*>(reparse->PathBuffer) + reparse->PrintNameOffset, print_name.c_str(), print_bytes);
+
+		if (!CreateDirectoryW(link.c_str(), nullptr))
+		{
+			return CopyBackend::LastError();
+		}
+
+		std::error_code ec;
+		{
+			CopyBackend::FileHandle directory(CreateFileW(link.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr));
+			DWORD returned = 0;
+			if (!directory.IsValid()
+				|| !DeviceIoControl(directory.Get(), FSCTL_SET_REPARSE_POINT, buffer.data(), static_cast<DWORD>(buffer.size()), nullptr, 0, &returned, nullptr))
+			{
+				ec = CopyBackend::LastError();
+			}
+		}
+
+		if (ec)
+		{
+			RemoveDirectoryW(link.c_str());
+		}
+		return ec;
+	}
+
+	std::error_code CreateFileSymlink(const fs::path& link, const fs::path& target)
+	{
+		if (!CreateSymbolicLinkW(link.c_str(), fs::absolute(target).c_str(), SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE))
+		{
+			return CopyBackend::LastError();
+		}
+		return {};
+	}
+
+	// Points link at target, replacing whatever link or folder was there.
+	// The new junction is built beside the old one, then the old one is renamed
+	// to retired and the new one renamed into place, so link only goes missing
+	// between two renames. The caller deletes retired. On failure link is left
+	// as it was.
+	std::error_code Relink(const fs::path& link, const fs::path& target, const fs::path& retired)
+	{
+		fs::path staging = link;
+		staging += ".relink";
+		if (IsLink(staging))
+		{
+			RemoveLink(staging);
+		}
+
+		std::error_code ec = CreateJunction(staging, target);
+		if (ec)
+		{
+			return ec;
+		}
+
+		// A link whose target is gone still has to be moved away.
+		bool replaced = IsLink(link) || fs::exists(link);
+		if (replaced && !MoveFileExW(link.c_str(), retired.c_str(), 0))
+		{
+			ec = CopyBackend::LastError();
+			RemoveLink(staging);
+			return ec;
+		}
+
+		if (!MoveFileExW(staging.c_str(), link.c_str(), 0))
+		{
+			ec = CopyBackend::LastError();
+			if (replaced)
+			{
+				MoveFileExW(retired.c_str(), link.c_str(), 0);
+			}
+			RemoveLink(staging);
+		}
+		return ec;
+	}
+}
@@ -0,0 +1,617 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include <filesystem>
+#include "BlobStore.h"
+#include "Hash.h"
+#include "Registry.h"
+
+namespace fs = std::filesystem;
+
+// Which profiles use a mod.
+// Every profile gets a number, and every content hash, file name and mod UUID
+// found in a profile maps to the set of profile numbers holding it, kept as a
+// compressed bitmap: per block of 65536 numbers, a sorted array of the low
+// 16 bits while the block holds few of them, a plain bit set beyond. Capturing
+// or deleting a profile only touches its own keys, and a query is a few hash
+// lookups and bitmap unions.
+namespace ModIndex
+{
+	constexpr const char* IndexFileName = "Mods.postings";
+	constexpr uint32_t IndexMagic = 0x54534F50;
+	constexpr uint32_t IndexVersion = 2;
+	// Far beyond any real index: a larger size in the header is damage.
+	constexpr uint64_t MaxIndexSize = 1ull << 30;
+	// Past this many numbers, a block is stored as a bit set.
+	constexpr size_t ArrayLimit = 4096;
+	constexpr size_t BlockBits = 1 << 16;
+	constexpr const char* HashKey = "h:";
+	constexpr const char* FileKey = "f:";
+	constexpr const char* UuidKey = "u:";
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t size;
+		// Hash of everything after the header.
+		uint64_t checksum;
+	};
+
+	class Bitmap
+	{
+	public:
+		void Add(uint32_t id)
+		{
+			Block& block = Get(id >> 16);
+			uint16_t low = static_cast<uint16_t>(id);
+			if (block.bits.empty())
+			{
+				auto it = std::lower_bound(block.array.begin(), block.array.end(), low);
+				if (it != block.array.end() && *it == low)
+				{
+					return;
+				}
+				block.array.insert(it, low);
+				if (block.array.size() > ArrayLimit)
+				{
+					ToBits(block);
+				}
+			}
+			else if (!TestBit(block, low))
+			{
+				block.bits[low >> 6] |= 1ull << (low & 63);
+				block.count++;
+			}
+		}
+
+		void Remove(uint32_t id)
+		{
+			auto block = Find(id >> 16);
+			if (block == blocks.end())
+			{
+				return;
+			}
+			uint16_t low = static_cast<uint16_t>(id);
+			if (block->bits.empty())
+			{
+				auto it = std::lower_bound(block->array.begin(), block->array.end(), low);
+				if (it != block->array.end() && *it == low)
+				{
+					block->array.erase(it);
+				}
+			}
+			else if (TestBit(*block, low))
+			{
+				block->bits[low >> 6] &= ~(1ull << (low & 63));
+				if (--block->count <= ArrayLimit)
+				{
+					ToArray(*block);
+				}
+			}
+			if (block->array.empty() && block->bits.empty())
+			{
+				blocks.erase(block);
+			}
+		}
+
+		bool Contains(uint32_t id) const
+		{
+			auto block = std::lower_bound(blocks.begin(), blocks.end(), static_cast<uint16_t>(id >> 16), [](const Block& lhs, uint16_t high) { return lhs.high < high; });
+			if (block == blocks.end() || block->high != (id >> 16))
+			{
+				return false;
+			}
+			uint16_t low = static_cast<uint16_t>(id);
+			return block->bits.empty() ? std::binary_search(block->array.begin(), block->array.end(), low) : TestBit(*block, low);
+		}
+
+		bool Empty() const
+		{
+			return blocks.empty();
+		}
+
+		Bitmap& operator|=(const Bitmap& other)
+		{
+			for (uint32_t id : other.Ids())
+			{
+				Add(id);
+			}
+			return *this;
+		}
+
+		// In increasing order.
+		std::vector<uint32_t> Ids() const
+		{
+			std::vector<uint32_t> ids;
+			for (const auto& block : blocks)
+			{
+				uint32_t base = static_cast<uint32_t>(block.high) << 16;
+				if (block.bits.empty())
+				{
+					for (uint16_t low : block.array)
+					{
+						ids.push_back(base | low);
+					}
+					continue;
+				}
+				for (size_t word = 0; word < block.bits.size(); word++)
+				{
+					for (uint64_t bits = block.bits[word]; bits; bits &= bits - 1)
+					{
+						ids.push_back(base | static_cast<uint32_t>(word * 64 + std::countr_zero(bits)));
+					}
+				}
+			}
+			return ids;
+		}
+
+		void Write(Registry::Encoder& encoder) const
+		{
+			encoder.Uint(blocks.size());
+			for (const auto& block : blocks)
+			{
+				encoder.Uint(block.high);
+				if (block.bits.empty())
+				{
+					encoder.Uint(0);
+					encoder.String(std::string_view(reinterpret_cast<const char*>(block.array.data()), block.array.size() * sizeof(uint16_t)));
+				}
+				else
+				{
+					encoder.Uint(1);
+					encoder.String(std::string_view(reinterpret_cast<const char*>(block.bits.data()), block.bits.size() * sizeof(uint64_t)));
+				}
+			}
+		}
+
+		bool Read(Registry::Decoder& decoder)
+		{
+			uint64_t count = 0;
+			if (!decoder.Uint(count))
+			{
+				return false;
+			}
+			blocks.clear();
+			for (uint64_t i = 0; i < count; i++)
+			{
+				uint64_t high = 0;
+				uint64_t dense = 0;
+				std::string bytes;
+				if (!decoder.Uint(high) || !decoder.Uint(dense) || !decoder.String(bytes))
+				{
+					return false;
+				}
+				Block block{ static_cast<uint16_t>(high) };
+				if (dense)
+				{
+					if (bytes.size() != BlockBits / 8)
+					{
+						return false;
+					}
+					block.bits.resize(BlockBits / 64);
+					std::memcpy(block.bits.data(), bytes.data(), bytes.size());
+					for (uint64_t word : block.bits)
+					{
+						block.count += std::popcount(word);
+					}
+				}
+				else
+				{
+					block.array.resize(bytes.size() / sizeof(uint16_t));
+					std::memcpy(block.array.data(), bytes.data(), block.array.size() * sizeof(uint16_t));
+				}
+				blocks.push_back(std::move(block));
+			}
+			return true;
+		}
+
+	private:
+		struct Block
+		{
+			uint16_t high = 0;
+			// Sorted low bits, while bits is empty.
+			std::vector<uint16_t> array;
+			std::vector<uint64_t> bits;
+			size_t count = 0;
+		};
+
+		std::vector<Block>::iterator Find(uint32_t high)
+		{
+			auto it = std::lower_bound(blocks.begin(), blocks.end(), high, [](const Block& lhs, uint32_t value) { return lhs.high < value; });
+			return it != blocks.end() && it->high == high ? it : blocks.end();
+		}
+
+		Block& Get(uint32_t high)
+		{
+			auto it = std::lower_bound(blocks.begin(), blocks.end(), high, [](const Block& lhs, uint32_t value) { return lhs.high < value; });
+			if (it == blocks.end() || it->high != high)
+			{
+				it = blocks.insert(it, Block{ static_cast<uint16_t>(high) });
+			}
+			return *it;
+		}
+
+		static bool TestBit(const Block& block, uint16_t low)
+		{
+			return (block.bits[low >> 6] >> (low & 63)) & 1;
+		}
+
+		static void ToBits(Block& block)
+		{
+			block.bits.assign(BlockBits / 64, 0);
+			for (uint16_t low : block.array)
+			{
+				block.bits[low >> 6] |= 1ull << (low & 63);
+			}
+			block.count = block.array.size();
+			block.array = {};
+		}
+
+		static void ToArray(Block& block)
+		{
+			block.array.clear();
+			for (size_t word = 0; word < block.bits.size(); word++)
+			{
+				for (uint64_t bits = block.bits[word]; bits; bits &= bits - 1)
+				{
+					block.array.push_back(static_cast<uint16_t>(word * 64 + std::countr_zero(bits)));
+				}
+			}
+			block.bits = {};
+			block.count = 0;
+		}
+
+		// Sorted by high.
+		std::vector<Block> blocks;
+	};
+
+	std::string Fold(std::string_view text)
+	{
+		size_t first = text.find_first_not_of(" \t\r\n\"");
+		size_t last = text.find_last_not_of(" \t\r\n\"");
+		std::string folded(first == std::string_view::npos ? std::string_view() : text.substr(first, last - first + 1));
+		std::transform(folded.begin(), folded.end(), folded.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return folded;
+	}
+
+	std::string FileName(std::string_view path)
+	{
+		size_t slash = path.find_last_of("/\\");
+		return Fold(slash == std::string_view::npos ? path : path.substr(slash + 1));
+	}
+
+	// UUIDs of the mods listed in a modsettings.lsx file.
+	std::vector<std::string> ListUuids(const fs::path& mod_list)
+	{
+		std::ifstream file(mod_list, std::ios::binary);
+		std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		std::vector<std::string> uuids;
+		for (size_t at = text.find("id=\"UUID\""); at != std::string::npos; at = text.find("id=\"UUID\"", at + 1))
+		{
+			size_t end = text.find('>', at);
+			size_t value = text.find("value=\"", at);
+			if (value == std::string::npos || value > end)
+			{
+				continue;
+			}
+			value += std::strlen("value=\"");
+			uuids.push_back(Fold(text.substr(value, text.find('"', value) - value)));
+		}
+		return uuids;
+	}
+
+	// Every key under which a profile holding manifest and listing uuids is found.
+	std::vector<std::string> Keys(const BlobStore::Manifest& manifest, const std::vector<std::string>& uuids)
+	{
+		std::vector<std::string> keys;
+		for (const auto& entry : manifest)
+		{
+			if (!entry.hash.empty())
+			{
+				keys.push_back(HashKey + Fold(entry.hash));
+			}
+			keys.push_back(FileKey + FileName(entry.name));
+		}
+		for (const auto& uuid : uuids)
+		{
+			keys.push_back(UuidKey + uuid);
+		}
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+		return keys;
+	}
+
+	class Index
+	{
+	public:
+		// Reads the index file. A missing, foreign or damaged file reads as an empty
+		// index, which SyncModIndex fills again from the manifests.
+		bool Open(const fs::path& index_path)
+		{
+			path = index_path;
+			profiles.clear();
+			stamps.clear();
+			ids.clear();
+			keys_of.clear();
+			postings.clear();
+			free_ids.clear();
+
+			std::ifstream input(path, std::ios::binary);
+			Header header{};
+			std::string body;
+			if (!input.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != IndexMagic || header.version != IndexVersion)
+			{
+				return false;
+			}
+			// The size is checked against the file before anything is allocated for it.
+			std::error_code ec;
+			uintmax_t file_size = fs::file_size(path, ec);
+			if (ec || header.size > MaxIndexSize || header.size != file_size - sizeof(header))
+			{
+				return false;
+			}
+			body.resize(static_cast<size_t>(header.size));
+			if (!input.read(body.data(), static_cast<std::streamsize>(body.size())) || Checksum(body) != header.checksum)
+			{
+				return false;
+			}
+
+			Registry::Decoder decoder(body);
+			uint64_t profile_count = 0;
+			uint64_t key_count = 0;
+			if (!decoder.Uint(profile_count))
+			{
+				return false;
+			}
+			for (uint64_t i = 0; i < profile_count; i++)
+			{
+				std::string name;
+				uint64_t stamp = 0;
+				if (!decoder.String(name) || !decoder.Uint(stamp))
+				{
+					return Reset();
+				}
+				if (name.empty())
+				{
+					free_ids.push_back(static_cast<uint32_t>(i));
+				}
+				else
+				{
+					ids[name] = static_cast<uint32_t>(i);
+				}
+				profiles.push_back(std::move(name));
+				stamps.push_back(stamp);
+			}
+			keys_of.resize(profiles.size());
+			if (!decoder.Uint(key_count))
+			{
+				return Reset();
+			}
+			for (uint64_t i = 0; i < key_count; i++)
+			{
+				std::string key;
+				Bitmap bitmap;
+				if (!decoder.String(key) || !bitmap.Read(decoder))
+				{
+					return Reset();
+				}
+				for (uint32_t id : bitmap.Ids())
+				{
+					if (id >= keys_of.size())
+					{
+						return Reset();
+					}
+					keys_of[id].push_back(key);
+				}
+				postings[std::move(key)] = std::move(bitmap);
+			}
+			return true;
+		}
+
+		// Writes the index beside the old file and renames it over it.
+		bool Save() const
+		{
+			Registry::Encoder encoder;
+			encoder.Uint(profiles.size());
+			for (size_t i = 0; i < profiles.size(); i++)
+			{
+				encoder.String(profiles[i]);
+				encoder.Uint(stamps[i]);
+			}
+			encoder.Uint(postings.size());
+			for (const auto& [key, bitmap] : postings)
+			{
+				encoder.String(key);
+				bitmap.Write(encoder);
+			}
+
+			const std::string& body = encoder.Bytes();
+			Header header{ IndexMagic, IndexVersion, body.size(), Checksum(body) };
+			fs::path temp = path;
+			temp += ".tmp";
+			{
+				std::ofstream output(temp, std::ios::binary | std::ios::trunc);
+				output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+				output.write(body.data(), static_cast<std::streamsize>(body.size()));
+				if (!output)
+				{
+					return false;
+				}
+			}
+			std::error_code ec;
+			fs::rename(temp, path, ec);
+			return !ec;
+		}
+
+		bool Contains(const std::string& profile) const
+		{
+			return ids.contains(profile);
+		}
+
+		// What the caller recorded about the content profile was indexed from, 0 when unknown.
+		uint64_t Stamp(const std::string& profile) const
+		{
+			auto it = ids.find(profile);
+			return it != ids.end() ? stamps[it->second] : 0;
+		}
+
+		// Names of the indexed profiles.
+		std::vector<std::string> Profiles() const
+		{
+			std::vector<std::string> names;
+			for (const auto& [name, id] : ids)
+			{
+				names.push_back(name);
+			}
+			return names;
+		}
+
+		// Replaces the keys of profile: it leaves the postings of the keys it no
+		// longer has and joins those of its new ones. stamp is returned by Stamp.
+		void Update(const std::string& profile, std::vector<std::string> keys, uint64_t stamp = 0)
+		{
+			auto [it, inserted] = ids.try_emplace(profile, static_cast<uint32_t>(profiles.size()));
+			if (inserted && !free_ids.empty())
+			{
+				it->second = free_ids.back();
+				free_ids.pop_back();
+				profiles[it->second] = profile;
+			}
+			else if (inserted)
+			{
+				profiles.push_back(profile);
+				stamps.push_back(0);
+				keys_of.emplace_back();
+			}
+			uint32_t id = it->second;
+			stamps[id] = stamp;
+
+			std::sort(keys.begin(), keys.end());
+			std::vector<std::string>& old_keys = keys_of[id];
+			std::sort(old_keys.begin(), old_keys.end());
+			std::vector<std::string> gone;
+			std::vector<std::string> added;
+			std::set_difference(old_keys.begin(), old_keys.end(), keys.begin(), keys.end(), std::back_inserter(gone));
+			std::set_difference(keys.begin(), keys.end(), old_keys.begin(), old_keys.end(), std::back_inserter(added));
+			for (const auto& key : gone)
+			{
+				Leave(key, id);
+			}
+			for (const auto& key : added)
+			{
+				postings[key].Add(id);
+			}
+			old_keys = std::move(keys);
+		}
+
+		void Remove(const std::string& profile)
+		{
+			auto it = ids.find(profile);
+			if (it == ids.end())
+			{
+				return;
+			}
+			uint32_t id = it->second;
+			for (const auto& key : keys_of[id])
+			{
+				Leave(key, id);
+			}
+			keys_of[id].clear();
+			// The number is free again: no posting holds it anymore.
+			profiles[id].clear();
+			stamps[id] = 0;
+			free_ids.push_back(id);
+			ids.erase(it);
+		}
+
+		// Profiles holding term, read as a content hash, a mod UUID and a file name
+		// (or the path of one) at once.
+		Bitmap Query(std::string_view term) const
+		{
+			Bitmap result;
+			for (const std::string& key : { HashKey + Fold(term), UuidKey + Fold(term), FileKey + FileName(Fold(term)) })
+			{
+				auto it = postings.find(key);
+				if (it != postings.end())
+				{
+					result |= it->second;
+				}
+			}
+			return result;
+		}
+
+		std::vector<Bitmap> Query(const std::vector<std::string>& terms) const
+		{
+			std::vector<Bitmap> results;
+			results.reserve(terms.size());
+			for (const auto& term : terms)
+			{
+				results.push_back(Query(term));
+			}
+			return results;
+		}
+
+		std::vector<std::string> Names(const Bitmap& bitmap) const
+		{
+			std::vector<std::string> names;
+			for (uint32_t id : bitmap.Ids())
+			{
+				names.push_back(profiles[id]);
+			}
+			return names;
+		}
+
+	private:
+		static uint64_t Checksum(std::string_view body)
+		{
+			Hash::Hasher hasher;
+			hasher.Update(body.data(), body.size());
+			return hasher.Final();
+		}
+
+		bool Reset()
+		{
+			profiles.clear();
+			stamps.clear();
+			ids.clear();
+			keys_of.clear();
+			postings.clear();
+			free_ids.clear();
+			return false;
+		}
+
+		void Leave(const std::string& key, uint32_t id)
+		{
+			auto it = postings.find(key);
+			if (it == postings.end())
+			{
+				return;
+			}
+			it->second.Remove(id);
+			if (it->second.Empty())
+			{
+				postings.erase(it);
+			}
+		}
+
+		fs::path path;
+		// Indexed by profile number; a deleted profile leaves an empty name.
+		std::vector<std::string> profiles;
+		std::vector<uint64_t> stamps;
+		std::unordered_map<std::string, uint32_t> ids;
+		std::vector<std::vector<std::string>> keys_of;
+		std::unordered_map<std::string, Bitmap> postings;
+		std::vector<uint32_t> free_ids;
+	};
+}
@@ -1,11 +1,30 @@
+#include <chrono>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <thread>
+#include <unordered_map>
 #include <windows.h>
 #include <shlobj.h>
+#include <conio.h>
 #include "nfd.h"
 #include "Tools.h"
 #include "JSON/json.hpp"
+#include "BlobStore.h"
+#include "Activation.h"
+#include "Probe.h"
+#include "History.h"
+#include "Prestage.h"
+#include "Journal.h"
+#include "Fingerprint.h"
+#include "FolderIndex.h"
+#include "Scanner.h"
+#include "Trash.h"
+#include "Registry.h"
+#include "Repository.h"
+#include "NameIndex.h"
+#include "ModIndex.h"
 
 using namespace nlohmann;
 
@@ -15,35 +34,130 @@ constexpr const char* SettingsHolderName = "Settings";
 constexpr const char* ModsListSettingsPath = "PlayerProfiles\\Public\\modsettings.lsx";
 constexpr const char* ModListFilename = "modsettings.lsx";
 constexpr const char* InvalidProfileName = "-1";
+constexpr const char* PrestageLogFileName = "Prestage.log";
+constexpr const char* BenchHashArgument = "--bench-hash";
+constexpr size_t BenchHashBufferSize = 256 << 20;
+constexpr int BenchHashRounds = 4;
+constexpr const char* BenchIoArgument = "--bench-io";
+constexpr size_t BenchIoSmallFiles = 10000;
+constexpr size_t BenchIoSmallSize = 16 << 10;
+constexpr size_t BenchIoLargeFiles = 4;
+constexpr size_t BenchIoLargeSize = 256 << 20;
+constexpr const char* ExportProfilesArgument = "--export-profiles";
+constexpr const char* ExportFileName = "Profiles.export.json";
+constexpr const char* WhoUsesArgument = "--who-uses";
 constexpr int Indent = 4;
+constexpr size_t ProfilePageSize = 20;
+constexpr auto ReclaimAfterLaunchTimeout = std::chrono::seconds(30);
+constexpr int KeyEnter = '\r';
+constexpr int KeyEscape = 27;
+constexpr int KeyBackspace = '\b';
+// _getch returns one of these before the code of an arrow or page key.
+constexpr int KeyExtended = 0;
+constexpr int KeyExtendedAlt = 224;
+constexpr int KeyUp = 72;
+constexpr int KeyDown = 80;
+constexpr int KeyPageUp = 73;
+constexpr int KeyPageDown = 81;
+
+enum class ActivationMode
+{
+	Files,
+	Junction,
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(ActivationMode, {
+	{ ActivationMode::Files, "files" },
+	{ ActivationMode::Junction, "junction" },
+})
 
 struct Settings
 {
 	std::string exec_mods_folder_path;
 	std::string mods_storage_path;
+	bool verify_mods_hash = false;
+	unsigned copy_threads = 0;
+	ActivationMode activation_mode = ActivationMode::Files;
 };
 
 struct Profile
 {
 	std::string name = InvalidProfileName;
 	std::string access_path = InvalidProfileName;
+	// Root hash of the profile's mods and mod list, see Utils::ProfileFingerprint.
+	std::string fingerprint;
 };
 
 
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Profile, name, access_path)
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Settings, exec_mods_folder_path, mods_storage_path)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(Profile, name, access_path, fingerprint)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(Settings, exec_mods_folder_path, mods_storage_path, verify_mods_hash, copy_threads, activation_mode)
 
 namespace
 {
-	using Data = std::pair<Settings, std::vector<Profile>>;
-	Data GlobalData = {};
+	// Registry payloads of the settings and profiles.
+	struct RecordCodec
+	{
+		static std::string Encode(const Settings& settings)
+		{
+			Registry::Encoder encoder;
+			encoder.String(settings.exec_mods_folder_path);
+			encoder.String(settings.mods_storage_path);
+			encoder.Uint(settings.verify_mods_hash);
+			encoder.Uint(settings.copy_threads);
+			encoder.Uint(static_cast<uint64_t>(settings.activation_mode));
+			return encoder.Bytes();
+		}
+
+		static bool Decode(std::string_view payload, Settings& settings)
+		{
+			Registry::Decoder decoder(payload);
+			uint64_t verify = 0;
+			uint64_t threads = 0;
+			uint64_t mode = 0;
+			if (!decoder.String(settings.exec_mods_folder_path) || !decoder.String(settings.mods_storage_path)
+				|| !decoder.Uint(verify) || !decoder.Uint(threads) || !decoder.Uint(mode))
+			{
+				return false;
+			}
+			settings.verify_mods_hash = verify != 0;
+			settings.copy_threads = static_cast<unsigned>(threads);
+			settings.activation_mode = static_cast<ActivationMode>(mode);
+			return true;
+		}
+
+		static std::string Encode(const Profile& profile)
+		{
+			Registry::Encoder encoder;
+			encoder.String(profile.name);
+			encoder.String(profile.access_path);
+			encoder.String(profile.fingerprint);
+			return encoder.Bytes();
+		}
+
+		static bool Decode(std::string_view payload, Profile& profile)
+		{
+			Registry::Decoder decoder(payload);
+			return decoder.String(profile.name) && decoder.String(profile.access_path) && decoder.String(profile.fingerprint);
+		}
+	};
+
+	using ProfileRepository = Repository::ProfileRepository<Settings, Profile, RecordCodec>;
+	ProfileRepository GlobalProfiles;
+	NameIndex::Index GlobalProfileNames;
+	ModIndex::Index GlobalModUsage;
+	Probe::Capabilities GlobalCapabilities = {};
+	Trash::Reclaimer GlobalReclaimer;
+	FolderIndex::Index GlobalModsIndex;
+	std::string GlobalActiveProfile;
+	History::Data GlobalHistory = {};
+	Prestage::Stager GlobalPrestager;
 	bool LeaveProgram;
 
 
 	namespace Utils
 	{
 
-		Settings CreateSettings()
+		Settings CreateSettings(Settings settings = {})
 		{
 			std::cout << "Please select your Baldur's Gate 3 mods folder \n";
 			std::ostringstream oss;
@@ -55,137 +169,583 @@ namespace
 			oss = {};
 			std::string mods_storage = SelectFolder("C:\\");
 
-			return Settings{ .exec_mods_folder_path = mods_folder,  .mods_storage_path = mods_storage };
+			std::cout << "How should profiles be activated ?\n"
+				<< "\t1 - Link or copy the mod files into the mods folder\n"
+				<< "\t2 - Turn the mods folder into a junction to the profile (no copy, instant switch)\n";
+			settings.activation_mode = GetSecureNumericInput(1, 2, "Choose an activation mode : ") == 2 ? ActivationMode::Junction : ActivationMode::Files;
+
+			settings.exec_mods_folder_path = mods_folder;
+			settings.mods_storage_path = mods_storage;
+			return settings;
 		}
 
-		void CreateDefaultProfile()
+		// Replaces the registry with the content of a JSON file in the Profile.ini
+		// layout, then renames the file so it is only imported once.
+		bool ImportProfiles(const fs::path& path)
 		{
 			json parser;
+			Settings settings;
+			std::vector<Profile> profiles;
+			try
+			{
+				std::ifstream file(path);
+				file >> parser;
+				profiles = parser.at(ProfilesHolderName).get<std::vector<Profile>>();
+				settings = parser.at(SettingsHolderName).get<Settings>();
+			}
+			catch (const json::exception& e)
+			{
+				std::cerr << "Erreur: " << e.what() << std::endl;
+				return false;
+			}
 
-			parser[SettingsHolderName] = CreateSettings();
+			// Moved aside first: a file left in place would replace the registry on every start.
+			fs::path imported = path;
+			imported += ".bak";
+			std::error_code ec;
+			fs::rename(path, imported, ec);
+			if (ec)
+			{
+				std::cerr << "Erreur: cannot rename " << path.string() << " (" << ec.message() << "), it is not imported\n";
+				return false;
+			}
+
+			GlobalProfiles.Import(settings, profiles);
+
+			std::ostringstream oss;
+			oss << profiles.size() << " profiles imported from " << path.string() << "\n";
+			std::cout << oss.str();
+			return true;
+		}
 
-			parser[ProfilesHolderName] = json::array();
+		void ExportProfiles(const fs::path& path)
+		{
+			json parser;
+			parser[SettingsHolderName] = GlobalProfiles.Settings();
+			parser[ProfilesHolderName] = GlobalProfiles.Profiles();
 
-			std::ofstream file(SettingFileName);
+			std::ofstream file(path);
 			file << parser.dump(Indent);
 			file.close();
 
 			std::ostringstream oss;
-			oss << "Default " << SettingFileName << " Created with success !\n";
+			oss << GlobalProfiles.Profiles().size() << " profiles exported to " << path.string() << ", to import it back rename it " << SettingFileName << " next to the executable and restart\n";
 			std::cout << oss.str();
 		}
 
-		void CheckAndLoadProfile()
+		// Maps the registry, importing Profile.ini first when one is waiting:
+		// the file left by older versions, or an export edited by hand.
+		void OpenRegistry()
 		{
-			if (!fs::exists(SettingFileName))
+			GlobalProfiles.Open(Registry::RegistryFileName);
+			if (fs::exists(SettingFileName))
 			{
-				std::ostringstream oss;
-				oss << "Cannot find " << SettingFileName << ", creating default file\n";
-				std::cout << oss.str();
-				CreateDefaultProfile();
-				std::cout << "\n\n";
+				ImportProfiles(SettingFileName);
 			}
 
-			json parser;
-			Settings settings;
-			std::vector<Profile> profiles;
-			std::ifstream file(SettingFileName);
-			file >> parser;
-			try
+			GlobalProfileNames.Clear();
+			for (const auto& profile : GlobalProfiles.Profiles())
 			{
-				profiles = parser.at(ProfilesHolderName).get<std::vector<Profile>>();
-				settings = parser.at(SettingsHolderName).get<Settings>();
+				GlobalProfileNames.Add(profile.name);
 			}
-			catch (const json::exception& e)
+		}
+
+		void CheckAndLoadProfile()
+		{
+			OpenRegistry();
+			if (!GlobalProfiles.HasSettings())
 			{
-				std::cerr << "Erreur: " << e.what() << std::endl;
+				std::cout << "Cannot find any settings, creating default ones\n";
+				GlobalProfiles.SetSettings(CreateSettings());
+				std::cout << "Default settings created with success !\n\n";
 			}
+			GlobalModsIndex.Open(FolderIndex::IndexFileName);
+			GlobalModUsage.Open(ModIndex::IndexFileName);
+		}
 
-			file.close();
-			GlobalData = { settings,profiles };
+		// Blanks the console and puts the cursor back on top, without the cost of CLS.
+		void ClearConsole()
+		{
+			HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+			CONSOLE_SCREEN_BUFFER_INFO info;
+			if (!GetConsoleScreenBufferInfo(console, &info))
+			{
+				return;
+			}
+			DWORD written = 0;
+			COORD origin{ 0, 0 };
+			FillConsoleOutputCharacterA(console, ' ', static_cast<DWORD>(info.dwSize.X) * info.dwSize.Y, origin, &written);
+			SetConsoleCursorPosition(console, origin);
 		}
 
-		void DisplayProfiles()
+		// Draws the page of matches holding the cursor, in a single write.
+		void DisplayProfiles(const std::string& filter, const std::vector<uint32_t>& matches, size_t cursor)
 		{
-			std::ostringstream oss;
-			oss << GlobalData.second.size() << " profile found :\n"
-				<< "\t0 - Go back to menu\n";
-			std::cout << oss.str();
+			size_t first = cursor / ProfilePageSize * ProfilePageSize;
+			size_t last = std::min(first + ProfilePageSize, matches.size());
+			size_t pages = std::max<size_t>(1, (matches.size() + ProfilePageSize - 1) / ProfilePageSize);
 
-			int index = 1;
-			for (auto profile : GlobalData.second)
+			std::ostringstream oss;
+			oss << GlobalProfileNames.Count() << " profile found, " << matches.size() << " matching, page " << first / ProfilePageSize + 1 << "/" << pages << "\n"
+				<< "Filter: " << filter << "\n\n";
+			for (size_t i = first; i < last; i++)
 			{
-				oss = {};
-				oss << "\t" << index++ << " - " << profile.name << "\n";
-				std::cout << oss.str();
+				oss << (i == cursor ? "  > " : "    ") << GlobalProfileNames.Name(matches[i]) << "\n";
 			}
+			for (size_t i = last; i < first + ProfilePageSize; i++)
+			{
+				oss << "\n";
+			}
+			oss << "\nType to filter, arrows and Page Up/Down to move, Enter to choose, Esc to go back to menu\n";
+
+			ClearConsole();
+			std::cout << oss.str() << std::flush;
 		}
 
 
+		// Paged list of the profiles, filtered as the user types: names that
+		// contain the filter, or start with it while it is shorter than three characters.
 		Profile ChooseProfile()
 		{
-			DisplayProfiles();
-			int choice = GetSecureNumericInput(0, static_cast<int>(GlobalData.second.size() + 1), "Choose a profile by his number : ") - 1;
-			if (choice == -1)
+			std::string filter;
+			std::vector<uint32_t> matches = GlobalProfileNames.Search(filter);
+			size_t cursor = 0;
+			for (;;)
 			{
-				return {};
+				DisplayProfiles(filter, matches, cursor);
+				int key = _getch();
+				if (key == KeyExtended || key == KeyExtendedAlt)
+				{
+					size_t end = matches.empty() ? 0 : matches.size() - 1;
+					switch (_getch())
+					{
+					case KeyUp:
+						cursor = cursor > 0 ? cursor - 1 : 0;
+						break;
+					case KeyDown:
+						cursor = std::min(cursor + 1, end);
+						break;
+					case KeyPageUp:
+						cursor = cursor > ProfilePageSize ? cursor - ProfilePageSize : 0;
+						break;
+					case KeyPageDown:
+						cursor = std::min(cursor + ProfilePageSize, end);
+						break;
+					default:
+						break;
+					}
+					continue;
+				}
+
+				if (key == KeyEscape)
+				{
+					ClearConsole();
+					return {};
+				}
+				if (key == KeyEnter)
+				{
+					if (!matches.empty())
+					{
+						ClearConsole();
+						return *GlobalProfiles.Find(GlobalProfileNames.Name(matches[cursor]));
+					}
+					continue;
+				}
+				if (key == KeyBackspace && !filter.empty())
+				{
+					filter.pop_back();
+				}
+				else if (std::isprint(key))
+				{
+					filter += static_cast<char>(key);
+				}
+				else
+				{
+					continue;
+				}
+				matches = GlobalProfileNames.Search(filter);
+				cursor = 0;
 			}
-			return GlobalData.second[choice];
 		}
 
 
 		void AddNewProfile(const Profile& new_profile)
 		{
-			std::ifstream ifile(SettingFileName);
-			json parser;
-			ifile >> parser;
-			ifile.close();
+			if (GlobalProfiles.Add(new_profile))
+			{
+				GlobalProfileNames.Add(new_profile.name);
+			}
+		}
 
-			parser[ProfilesHolderName].push_back(new_profile);
+		void RemoveProfile(const Profile& profile_to_delete)
+		{
+			GlobalProfiles.Remove(profile_to_delete.name);
+			GlobalProfileNames.Remove(profile_to_delete.name);
+			GlobalModUsage.Remove(profile_to_delete.name);
+			GlobalModUsage.Save();
+			if (profile_to_delete.name == GlobalActiveProfile)
+			{
+				GlobalActiveProfile.clear();
+			}
+		}
 
 
-			std::ofstream ofile(SettingFileName);
-			ofile << parser.dump(Indent);
-			ofile.close();
+		void SetProfileFingerprints(const std::map<std::string, std::string>& fingerprints)
+		{
+			for (const auto& [name, fingerprint] : fingerprints)
+			{
+				if (const Profile* profile = GlobalProfiles.Find(name))
+				{
+					Profile updated = *profile;
+					updated.fingerprint = fingerprint;
+					GlobalProfiles.Update(updated);
+				}
+			}
+		}
+
 
-			CheckAndLoadProfile();
+		void CreateProfileDirectory(const Profile& profile)
+		{
+			fs::create_directories(profile.access_path);
+			fs::create_directories(profile.access_path + "\\Mods");
 		}
 
-		void RemoveProfile(const Profile& profile_to_delete)
+		// Moves path to the trash and reclaims it in the background. A tree that
+		// cannot be renamed is reclaimed where it is.
+		void RemoveInBackground(const fs::path& path)
 		{
-			std::ifstream ifile(SettingFileName);
-			json parser;
-			ifile >> parser;
-			ifile.close();
+			fs::path trashed;
+			if (Trash::MoveToTrash(path, trashed))
+			{
+				trashed = path;
+			}
+			GlobalReclaimer.Add(trashed);
+		}
 
+		// Reclaims the trees deleted during earlier runs that were not finished.
+		void ResumeReclaim()
+		{
+			GlobalReclaimer.Resume(Trash::TrashFolder(GlobalProfiles.Settings().exec_mods_folder_path));
+			GlobalReclaimer.Resume(fs::path(GlobalProfiles.Settings().mods_storage_path) / Trash::TrashFolderName);
+		}
 
-			int index = 0;
-			for (int i = 0; i < parser[ProfilesHolderName].size(); i++)
+		void RecoverInterruptedSwitch()
+		{
+			for (const auto& retired : Activation::RecoverInterruptedSwitch(GlobalProfiles.Settings().exec_mods_folder_path))
 			{
-				if (parser[ProfilesHolderName][i].get<Profile>().name == profile_to_delete.name)
+				RemoveInBackground(retired);
+			}
+		}
+
+		void LoadCapabilities(bool force)
+		{
+			GlobalCapabilities = Probe::LoadOrRun(Probe::CapabilitiesFileName, GlobalProfiles.Settings().exec_mods_folder_path, GlobalProfiles.Settings().mods_storage_path, force);
+
+			std::ostringstream oss;
+			oss << "Same volume: " << (GlobalCapabilities.same_volume ? "yes" : "no")
+				<< ", hard links: " << (GlobalCapabilities.hard_links ? "yes" : "no")
+				<< ", hard links in the mods folder: " << (GlobalCapabilities.staging_links ? "yes" : "no")
+				<< ", block clone: " << (GlobalCapabilities.block_clone ? "yes" : "no")
+				<< ", junctions: " << (GlobalCapabilities.junctions ? "yes" : "no")
+				<< ", copy speed: " << FormatBytes(static_cast<uintmax_t>(GlobalCapabilities.copy_throughput)) << "/s\n";
+			std::cout << oss.str();
+		}
+
+		// Stages the profile most likely to be loaded next while the menu is idle.
+		// Only done when activation has to copy the mods: links and clones are
+		// already close to free, and only a staged switch can use the result.
+		void StartPrestage()
+		{
+			bool cheap_activation = GlobalCapabilities.same_volume && (GlobalCapabilities.hard_links || GlobalCapabilities.block_clone);
+			if (GlobalProfiles.Settings().activation_mode != ActivationMode::Files || cheap_activation || !GlobalCapabilities.staging_links)
+			{
+				return;
+			}
+
+			std::vector<std::string> names;
+			for (const auto& profile : GlobalProfiles.Profiles())
+			{
+				names.push_back(profile.name);
+			}
+
+			std::string predicted = History::Predict(GlobalHistory, names);
+			const Profile* profile = GlobalProfiles.Find(predicted);
+			if (!profile)
+			{
+				return;
+			}
+
+			BlobStore::Manifest manifest = BlobStore::LoadManifest(profile->access_path);
+			if (manifest.empty())
+			{
+				return;
+			}
+
+			// The prestaged copy sits beside the live folder until the switch: leave
+			// room for it and as much again.
+			uintmax_t bytes = 0;
+			for (const auto& entry : manifest)
+			{
+				bytes += entry.size;
+			}
+			std::error_code ec;
+			fs::space_info space = fs::space(fs::path(GlobalProfiles.Settings().exec_mods_folder_path).parent_path(), ec);
+			if (ec || space.available < 2 * bytes)
+			{
+				return;
+			}
+			GlobalPrestager.Start(GlobalProfiles.Settings().mods_storage_path, manifest, GlobalProfiles.Settings().exec_mods_folder_path, predicted, Prestage::DefaultBytesPerSecond);
+		}
+
+		// Moves the prestaged tree into the staging folder when it was built for profile,
+		// and logs whether the prediction was right.
+		bool UsePrestage(const Profile& profile)
+		{
+			GlobalPrestager.Cancel();
+			if (GlobalPrestager.Target().empty())
+			{
+				return false;
+			}
+
+			bool hit = GlobalPrestager.Target() == profile.name;
+			// The switch no longer copies what the prestage copied: estimated as the plan would have.
+			double saved = hit ? Probe::EstimateSeconds(GlobalCapabilities, Probe::Strategy::Copy, GlobalPrestager.FilesCopied(), GlobalPrestager.BytesCopied()) : 0.0;
+			GlobalHistory.predictions++;
+			if (hit)
+			{
+				GlobalHistory.hits++;
+				GlobalHistory.seconds_saved += saved;
+			}
+
+			std::ofstream log(PrestageLogFileName, std::ios::app);
+			log << "predicted=" << GlobalPrestager.Target() << " chosen=" << profile.name << " hit=" << hit
+				<< " complete=" << GlobalPrestager.Complete() << " prestage_time=" << GlobalPrestager.Seconds() << "s"
+				<< " copied=" << GlobalPrestager.FilesCopied() << " saved=" << saved << "s"
+				<< " hit_rate=" << GlobalHistory.hits << "/" << GlobalHistory.predictions
+				<< " total_saved=" << GlobalHistory.seconds_saved << "s\n";
+
+			GlobalPrestager.Reset();
+			if (!hit)
+			{
+				return false;
+			}
+
+			fs::path staging = Activation::SiblingPath(GlobalProfiles.Settings().exec_mods_folder_path, Activation::StagingSuffix);
+			BatchIo::RemoveTree(staging, GlobalProfiles.Settings().copy_threads);
+			std::error_code ec;
+			fs::rename(Prestage::PrestagePath(GlobalProfiles.Settings().exec_mods_folder_path), staging, ec);
+			return !ec;
+		}
+
+		void DisplayCopyReport(const CopyEngine::Report& report)
+		{
+			std::ostringstream oss;
+			oss << report.files << " files in " << report.seconds << "s, "
+				<< FormatBytes(report.bytes_copied) << " copied at " << FormatBytes(static_cast<uintmax_t>(report.Throughput())) << "/s\n";
+			for (size_t tier = 0; tier < report.by_tier.size(); tier++)
+			{
+				if (report.by_tier[tier] > 0)
+				{
+					oss << "\t" << report.by_tier[tier] << " by " << CopyBackend::TierNames[tier] << "\n";
+				}
+			}
+			for (const auto& error : report.errors)
+			{
+				oss << "\tFailed: " << error.path.string() << " : " << error.message << "\n";
+			}
+			std::cout << oss.str();
+		}
+
+		// Changes whenever the manifest or the mod list of profile is written again,
+		// so a profile indexed from older files is found without reading them.
+		uint64_t IndexStamp(const Profile& profile)
+		{
+			Hash::Hasher hasher;
+			for (const fs::path& file : { fs::path(profile.access_path) / BlobStore::ManifestFileName, fs::path(profile.access_path + "\\" + ModListFilename) })
+			{
+				std::error_code ec;
+				int64_t time = fs::last_write_time(file, ec).time_since_epoch().count();
+				if (ec)
 				{
-					index = i;
-					break;
+					time = 0;
 				}
+				hasher.Update(&time, sizeof(time));
 			}
+			return hasher.Final();
+		}
 
-			parser[ProfilesHolderName].erase(index);
+		// Files the mods of profile under their hashes, file names and UUIDs.
+		void IndexProfileMods(const Profile& profile, const BlobStore::Manifest& manifest)
+		{
+			GlobalModUsage.Update(profile.name, ModIndex::Keys(manifest, ModIndex::ListUuids(profile.access_path + "\\" + ModListFilename)), IndexStamp(profile));
+			GlobalModUsage.Save();
+		}
 
+		// Indexes the profiles the mod index does not know yet, the ones saved
+		// before it existed, again those whose manifest or mod list changed since
+		// they were indexed, and forgets those deleted since.
+		void SyncModIndex()
+		{
+			bool changed = false;
+			for (const auto& name : GlobalModUsage.Profiles())
+			{
+				if (!GlobalProfiles.Find(name))
+				{
+					GlobalModUsage.Remove(name);
+					changed = true;
+				}
+			}
+			for (const auto& profile : GlobalProfiles.Profiles())
+			{
+				uint64_t stamp = IndexStamp(profile);
+				if (!GlobalModUsage.Contains(profile.name) || GlobalModUsage.Stamp(profile.name) != stamp)
+				{
+					BlobStore::Manifest manifest = BlobStore::LoadManifest(profile.access_path);
+					GlobalModUsage.Update(profile.name, ModIndex::Keys(manifest, ModIndex::ListUuids(profile.access_path + "\\" + ModListFilename)), stamp);
+					changed = true;
+				}
+			}
+			if (changed)
+			{
+				GlobalModUsage.Save();
+			}
+		}
 
-			std::ofstream ofile(SettingFileName);
-			ofile << parser.dump(Indent);
-			ofile.close();
+		// Answers every term at once: a .pak name or path, a mod UUID or a content hash.
+		void DisplayModUsers(const std::vector<std::string>& terms)
+		{
+			auto start = std::chrono::steady_clock::now();
+			std::vector<ModIndex::Bitmap> results = GlobalModUsage.Query(terms);
+			double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
 
-			CheckAndLoadProfile();
+			std::ostringstream oss;
+			for (size_t i = 0; i < terms.size(); i++)
+			{
+				std::vector<std::string> names = GlobalModUsage.Names(results[i]);
+				oss << terms[i] << " : used by " << names.size() << " profiles\n";
+				for (const auto& name : names)
+				{
+					oss << "\t- " << name << "\n";
+				}
+			}
+			oss << terms.size() << " queries answered in " << std::fixed << std::setprecision(1) << microseconds << " us\n";
+			std::cout << oss.str();
 		}
 
+		void DisplayChanges(const BlobStore::Changes& changes, uintmax_t bytes_written, double seconds)
+		{
+			std::ostringstream oss;
+			oss << changes.added.size() << " added, " << changes.modified.size() << " modified, " << changes.removed.size() << " removed, "
+				<< changes.unchanged << " unchanged (" << FormatBytes(changes.new_bytes) << " of new content, "
+				<< FormatBytes(bytes_written) << " written) in " << seconds << "s\n";
+			for (const auto& name : changes.added)
+			{
+				oss << "\t+ " << name << "\n";
+			}
+			for (const auto& name : changes.modified)
+			{
+				oss << "\t~ " << name << "\n";
+			}
+			for (const auto& name : changes.removed)
+			{
+				oss << "\t- " << name << "\n";
+			}
+			std::cout << oss.str();
+		}
 
-		void CreateProfileDirectory(const Profile& profile)
+		// Records the Mods folder as it is now as the content of profile_name.
+		// known is the manifest just loaded into or captured from the folder.
+		void RecordModsFolder(const std::string& profile_name, const BlobStore::Manifest& known)
 		{
-			fs::create_directories(profile.access_path);
-			fs::create_directories(profile.access_path + "\\Mods");
+			uint64_t volume = 0;
+			std::vector<FolderIndex::Entry> entries = FolderIndex::Refresh(GlobalModsIndex, GlobalProfiles.Settings().exec_mods_folder_path, &known, volume);
+			GlobalModsIndex.Save(volume, profile_name, entries);
+			GlobalActiveProfile = profile_name;
 		}
 
+		// Content hash of a mod list, 0 when there is none.
+		uint64_t ListHash(const fs::path& path)
+		{
+			std::error_code ec;
+			return fs::exists(path, ec) ? Fingerprint::HashFile(path) : 0;
+		}
+
+		// Root of a Merkle tree over the mods of manifest, combined with the hash of the mod list.
+		std::string TreeFingerprint(const BlobStore::Manifest& manifest, uint64_t list_hash)
+		{
+			uint64_t root[2] = { BlobStore::TreeHash(manifest), list_hash };
+			Hash::Hasher hasher;
+			hasher.Update(root, sizeof(root));
+			return Hash::ToHex(hasher.Final());
+		}
+
+		std::string ProfileFingerprint(const Profile& profile, const BlobStore::Manifest& manifest)
+		{
+			return TreeFingerprint(manifest, ListHash(profile.access_path + "\\" + ModListFilename));
+		}
+
+		// Fingerprint of the Mods folder and the live mod list. The folder is only
+		// listed: hashes come from the folder index and the fingerprint cache.
+		std::string LiveFingerprint(const std::vector<FolderIndex::Entry>& entries)
+		{
+			return TreeFingerprint(FolderIndex::ToManifest(entries), ListHash(GlobalProfiles.Settings().exec_mods_folder_path + "\\..\\" + ModsListSettingsPath));
+		}
+
+		std::string LiveFingerprint()
+		{
+			uint64_t volume = 0;
+			std::vector<FolderIndex::Entry> entries = FolderIndex::Refresh(GlobalModsIndex, GlobalProfiles.Settings().exec_mods_folder_path, nullptr, volume);
+			GlobalModsIndex.Save(volume, std::string(GlobalModsIndex.Profile()), entries);
+			return LiveFingerprint(entries);
+		}
+
+		// Gives a fingerprint to the profiles saved before fingerprints existed.
+		// A profile without a manifest has never been snapshotted: its fingerprint
+		// stays empty until its first capture or load, rather than describing nothing.
+		void FillProfileFingerprints()
+		{
+			std::map<std::string, std::string> fingerprints;
+			for (const auto& profile : GlobalProfiles.Profiles())
+			{
+				if (profile.fingerprint.empty() && fs::exists(fs::path(profile.access_path) / BlobStore::ManifestFileName))
+				{
+					fingerprints[profile.name] = ProfileFingerprint(profile, BlobStore::LoadManifest(profile.access_path));
+				}
+			}
+			if (!fingerprints.empty())
+			{
+				SetProfileFingerprints(fingerprints);
+			}
+		}
+
+		// Finds the profile whose fingerprint matches the Mods folder, and otherwise
+		// tells what changed since the profile recorded in the folder index.
+		void CheckModsFolder()
+		{
+			auto start = std::chrono::steady_clock::now();
+			uint64_t volume = 0;
+			std::vector<FolderIndex::Entry> entries = FolderIndex::Refresh(GlobalModsIndex, GlobalProfiles.Settings().exec_mods_folder_path, nullptr, volume);
+			std::string live = LiveFingerprint(entries);
+			auto active = std::find_if(GlobalProfiles.Profiles().begin(), GlobalProfiles.Profiles().end(), [&](const Profile& p) { return p.fingerprint == live; });
+			GlobalActiveProfile = active != GlobalProfiles.Profiles().end() ? active->name : std::string();
+
+			const Profile* recorded = GlobalProfiles.Find(std::string(GlobalModsIndex.Profile()));
+			std::string recorded_name = !GlobalActiveProfile.empty() ? GlobalActiveProfile : recorded ? recorded->name : std::string();
+			GlobalModsIndex.Save(volume, recorded_name, entries);
+			if (!GlobalActiveProfile.empty() || !recorded)
+			{
+				return;
+			}
+
+			BlobStore::Changes changes = BlobStore::Compare(BlobStore::LoadManifest(recorded->access_path), FolderIndex::ToManifest(entries));
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "Mods folder changed since the " << recorded->name << " profile was loaded:\n";
+			DisplayChanges(changes, 0, seconds);
+		}
+
+		// Brings the profile up to date with the Mods folder: only the files added or
+		// changed since the last capture are hashed and stored, the removed ones are
+		// dropped from the profile.
 		void CopyCurrentMods(const Profile& profile)
 		{
 			if (profile.name == InvalidProfileName)
@@ -193,8 +753,204 @@ namespace
 				return;
 			}
 
-			fs::copy(GlobalData.first.exec_mods_folder_path, profile.access_path + "\\Mods", fs::copy_options::recursive | fs::copy_options::overwrite_existing);
-			fs::copy(GlobalData.first.exec_mods_folder_path + "\\..\\" + ModsListSettingsPath, profile.access_path, fs::copy_options::recursive | fs::copy_options::recursive | fs::copy_options::overwrite_existing);
+			auto start = std::chrono::steady_clock::now();
+			const std::string& storage_path = GlobalProfiles.Settings().mods_storage_path;
+			Journal::Writer journal(Journal::JournalFileName, "capture", profile.name);
+			std::vector<CopyEngine::Error> errors;
+			BlobStore::Manifest previous = BlobStore::LoadManifest(profile.access_path);
+			BlobStore::Manifest manifest = BlobStore::Snapshot(storage_path, GlobalProfiles.Settings().exec_mods_folder_path, previous, GlobalProfiles.Settings().verify_mods_hash, GlobalProfiles.Settings().copy_threads, errors, &journal);
+
+			Activation::Result result = Activation::Synchronize(storage_path, manifest, profile.access_path + "\\Mods", false, GlobalProfiles.Settings().copy_threads, CopyBackend::Tier::Link, &journal);
+			result.copy.errors.insert(result.copy.errors.end(), errors.begin(), errors.end());
+			BlobStore::SaveManifest(profile.access_path, manifest);
+
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			DisplayChanges(BlobStore::Compare(previous, manifest), result.copy.bytes_copied, seconds);
+			for (const auto& error : result.copy.errors)
+			{
+				std::cout << "\tFailed: " << error.path.string() << " : " << error.message << "\n";
+			}
+
+			// In link mode the live mod list may already be a link to this very file.
+			std::error_code ec;
+			if (!fs::equivalent(GlobalProfiles.Settings().exec_mods_folder_path + "\\..\\" + ModsListSettingsPath, profile.access_path + "\\" + ModListFilename, ec))
+			{
+				fs::copy(GlobalProfiles.Settings().exec_mods_folder_path + "\\..\\" + ModsListSettingsPath, profile.access_path, fs::copy_options::recursive | fs::copy_options::recursive | fs::copy_options::overwrite_existing);
+			}
+			IndexProfileMods(profile, manifest);
+			RecordModsFolder(profile.name, manifest);
+			SetProfileFingerprints({ { profile.name, ProfileFingerprint(profile, manifest) } });
+			journal.Commit();
+		}
+
+		// Reports the throughput of every hash kernel this CPU supports on an in-memory
+		// buffer, then of the whole pipeline (disk reads, all cores) on the files of folder.
+		void BenchmarkHash(const fs::path& folder)
+		{
+			std::vector<unsigned char> buffer(BenchHashBufferSize);
+			uint64_t state = Hash::Prime64_1;
+			for (auto& byte : buffer)
+			{
+				state = state * Hash::Prime64_2 + Hash::Prime64_3;
+				byte = static_cast<unsigned char>(state >> 56);
+			}
+
+			std::ostringstream oss;
+			oss << "Hashing " << FormatBytes(buffer.size()) << " in memory, " << BenchHashRounds << " rounds per kernel\n";
+			for (const auto& kernel : Hash::AvailableKernels())
+			{
+				auto start = std::chrono::steady_clock::now();
+				Hash::Hasher hasher(kernel.accumulate);
+				for (int round = 0; round < BenchHashRounds; round++)
+				{
+					hasher.Update(buffer.data(), buffer.size());
+				}
+				uint64_t hash = hasher.Final();
+				double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				oss << "\t" << kernel.name << (kernel.accumulate == Hash::BestKernel().accumulate ? " (selected)" : "")
+					<< ": " << static_cast<double>(buffer.size()) * BenchHashRounds / seconds / 1e9 << " GB/s, hash " << Hash::ToHex(hash) << "\n";
+			}
+			std::cout << oss.str();
+
+			if (folder.empty() || !fs::exists(folder))
+			{
+				return;
+			}
+
+			std::vector<fs::path> files;
+			uintmax_t bytes = 0;
+			for (const auto& file : Scanner::Scan(folder).files)
+			{
+				files.push_back(folder / Scanner::PathOf(file.name));
+				bytes += file.size;
+			}
+
+			unsigned threads = CopyEngine::ResolveParallelism(0);
+			auto start = std::chrono::steady_clock::now();
+			CopyEngine::ParallelFor(files.size(), threads, [&](size_t i)
+				{
+					try
+					{
+						Hash::HashFile(files[i]);
+					}
+					catch (const std::exception& e)
+					{
+						std::cerr << "Erreur: " << e.what() << std::endl;
+					}
+				});
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			oss = {};
+			oss << files.size() << " files (" << FormatBytes(bytes) << ") hashed from disk on " << threads << " threads in " << seconds << "s: "
+				<< (seconds > 0.0 ? static_cast<double>(bytes) / seconds / 1e9 : 0.0) << " GB/s\n";
+			std::cout << oss.str();
+		}
+
+		// Copies then deletes a tree of many small files and a few large ones in
+		// scratch, once through the thread pool and once through the overlapped
+		// backend, and prints how fast each one went.
+		void BenchmarkIo(const fs::path& scratch)
+		{
+			fs::path source = scratch / "source";
+			fs::create_directories(source);
+			std::vector<BatchIo::Transfer> transfers;
+			std::vector<char> data(BenchIoLargeSize, 'x');
+			uintmax_t bytes = 0;
+			for (size_t i = 0; i < BenchIoSmallFiles + BenchIoLargeFiles; i++)
+			{
+				size_t size = i < BenchIoSmallFiles ? BenchIoSmallSize : BenchIoLargeSize;
+				fs::path file = source / std::to_string(i / 1000) / (std::to_string(i) + ".pak");
+				fs::create_directories(file.parent_path());
+				std::ofstream(file, std::ios::binary).write(data.data(), size);
+				transfers.push_back({ file, fs::path(), size });
+				bytes += size;
+			}
+
+			auto report = [&](const std::string& name, size_t files, uintmax_t size, double seconds)
+				{
+					std::ostringstream oss;
+					oss << "\t" << name << ": " << files << " files in " << seconds << "s, "
+						<< static_cast<size_t>(files / seconds) << " files/s";
+					if (size > 0)
+					{
+						oss << ", " << static_cast<double>(size) / seconds / 1e6 << " MB/s";
+					}
+					std::cout << oss.str() << "\n";
+				};
+
+			std::cout << "Copying " << transfers.size() << " files (" << FormatBytes(bytes) << ")\n";
+			auto copy_to = [&](const fs::path& destination)
+				{
+					for (auto& transfer : transfers)
+					{
+						transfer.destination = destination / fs::relative(transfer.source, source);
+					}
+				};
+
+			copy_to(scratch / "threads");
+			auto start = std::chrono::steady_clock::now();
+			CopyEngine::ParallelFor(transfers.size(), 0, [&](size_t i)
+				{
+					std::error_code ec;
+					fs::create_directories(transfers[i].destination.parent_path(), ec);
+					CopyBackend::CopyWithBestTier(transfers[i].source, transfers[i].destination, transfers[i].size, CopyBackend::Tier::Kernel);
+				});
+			report("threads", transfers.size(), bytes, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+			copy_to(scratch / "overlapped");
+			start = std::chrono::steady_clock::now();
+			BatchIo::CopyFiles(transfers);
+			report("overlapped", transfers.size(), bytes, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+			std::cout << "Deleting " << transfers.size() << " files\n";
+			start = std::chrono::steady_clock::now();
+			std::error_code ec;
+			fs::remove_all(scratch / "threads", ec);
+			report("remove_all", transfers.size(), 0, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+			start = std::chrono::steady_clock::now();
+			BatchIo::RemoveTree(scratch / "overlapped");
+			report("parallel delete", transfers.size(), 0, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+			BatchIo::RemoveTree(source);
+		}
+
+		// Finishes an activation or a capture interrupted by a crash, from the last
+		// operation the journal marked done. Must run before RecoverInterruptedSwitch,
+		// which would drop the staging tree.
+		void ResumeJournal()
+		{
+			std::optional<Journal::Pending> pending = Journal::Load(Journal::JournalFileName);
+			if (!pending)
+			{
+				Journal::Discard(Journal::JournalFileName);
+				return;
+			}
+
+			std::cout << "Resuming the interrupted " << pending->kind << " of " << pending->subject << " (" << pending->ops.size() << " operations left)...\n";
+			CopyEngine::Report report = Journal::Replay(*pending, GlobalProfiles.Settings().copy_threads);
+			DisplayCopyReport(report);
+
+			const Profile* profile = GlobalProfiles.Find(pending->subject);
+			if (report.errors.empty() && profile)
+			{
+				if (pending->kind == "activate")
+				{
+					fs::path staging = Activation::SiblingPath(GlobalProfiles.Settings().exec_mods_folder_path, Activation::StagingSuffix);
+					bool swap_pending = std::any_of(pending->ops.begin(), pending->ops.end(), [](const Journal::Op& op) { return op.kind == Journal::OpKind::Swap; });
+					fs::path retired;
+					if (swap_pending && fs::exists(staging) && !Activation::SwapStaged(GlobalProfiles.Settings().exec_mods_folder_path, retired))
+					{
+						RemoveInBackground(retired);
+					}
+					Activation::InstallFile(profile->access_path + "\\" + ModListFilename, GlobalProfiles.Settings().exec_mods_folder_path + "\\..\\" + ModsListSettingsPath, GlobalProfiles.Settings().activation_mode == ActivationMode::Junction);
+					RecordModsFolder(profile->name, BlobStore::LoadManifest(profile->access_path));
+				}
+				else if (pending->kind == "capture")
+				{
+					CopyCurrentMods(*profile);
+				}
+			}
+			Journal::Discard(Journal::JournalFileName);
 		}
 
 	}
@@ -202,6 +958,7 @@ namespace
 	namespace Commands
 	{
 		void Leave();
+		void LaunchGame(const Profile& profile);
 
 		void SelectProfileAndLaunch()
 		{
@@ -213,15 +970,123 @@ namespace
 
 			std::cout << "Loading " << profile.name << " profile...\n";
 
-			fs::remove_all(GlobalData.first.exec_mods_folder_path);
+			const std::string& storage_path = GlobalProfiles.Settings().mods_storage_path;
+			Journal::Writer journal(Journal::JournalFileName, "activate", profile.name);
+			std::vector<CopyEngine::Error> errors;
+			BlobStore::Manifest manifest = BlobStore::Snapshot(storage_path, profile.access_path + "\\Mods", BlobStore::LoadManifest(profile.access_path), false, GlobalProfiles.Settings().copy_threads, errors, &journal);
+			BlobStore::SaveManifest(profile.access_path, manifest);
+			Utils::IndexProfileMods(profile, manifest);
 
-			fs::copy(profile.access_path + "\\Mods", GlobalData.first.exec_mods_folder_path, fs::copy_options::recursive | fs::copy_options::overwrite_existing);
-			fs::copy(profile.access_path + "\\" + ModListFilename, GlobalData.first.exec_mods_folder_path + "\\..\\" + ModsListSettingsPath, fs::copy_options::recursive | fs::copy_options::overwrite_existing);
+			std::string fingerprint = Utils::ProfileFingerprint(profile, manifest);
+			if (fingerprint != profile.fingerprint)
+			{
+				Utils::SetProfileFingerprints({ { profile.name, fingerprint } });
+			}
+			if (fingerprint == Utils::LiveFingerprint())
+			{
+				std::cout << profile.name << " is already active, the mods folder is left as it is.\n";
+				journal.Commit();
+				LaunchGame(profile);
+				return;
+			}
+
+			bool use_links = GlobalProfiles.Settings().activation_mode == ActivationMode::Junction;
+			bool linked = false;
+			if (use_links && Probe::Choose(GlobalCapabilities, true, 0, 0).strategy == Probe::Strategy::Junction)
+			{
+				fs::path retired = Activation::RetiredPath(GlobalProfiles.Settings().exec_mods_folder_path);
+				std::error_code ec = Links::Relink(GlobalProfiles.Settings().exec_mods_folder_path, profile.access_path + "\\Mods", retired);
+				linked = !ec;
+				if (ec)
+				{
+					std::cout << "Cannot link the mods folder (" << ec.message() << "), copying the mods instead.\n";
+				}
+				else if (Links::IsLink(retired))
+				{
+					Links::RemoveLink(retired);
+				}
+				else if (fs::exists(retired))
+				{
+					Utils::RemoveInBackground(retired);
+				}
+			}
+
+			if (linked)
+			{
+				std::cout << "Mods folder linked to " << profile.access_path << "\\Mods\n";
+			}
+			else
+			{
+				Activation::DetachLinkedFolder(GlobalProfiles.Settings().exec_mods_folder_path);
+
+				// A prestaged tree only needs the changes made since it was built.
+				fs::path staging = Activation::SiblingPath(GlobalProfiles.Settings().exec_mods_folder_path, Activation::StagingSuffix);
+				bool prestaged = GlobalCapabilities.staging_links && Utils::UsePrestage(profile);
+				Activation::Plan plan = Activation::BuildPlan(manifest, prestaged ? staging : fs::path(GlobalProfiles.Settings().exec_mods_folder_path), GlobalProfiles.Settings().verify_mods_hash);
+
+				Probe::Estimate estimate = Probe::Choose(GlobalCapabilities, false, plan.to_add.size(), plan.bytes_to_add);
+				std::cout << plan.to_add.size() << " mods (" << FormatBytes(plan.bytes_to_add) << ") to install using "
+					<< Probe::StrategyNames[static_cast<size_t>(estimate.strategy)] << ", estimated time: " << estimate.seconds << "s\n";
+
+				// The swap is planned with the rest, so a resumed switch still ends with it.
+				uint64_t swap_id = GlobalCapabilities.staging_links ? journal.Add(Journal::OpKind::Swap, staging, GlobalProfiles.Settings().exec_mods_folder_path) : 0;
+
+				// Staging links the kept files from the live folder, so it only needs hard
+				// links inside the Mods volume, wherever the storage is. Without them every
+				// kept file would be copied again, so update in place instead.
+				Activation::Result result;
+				if (prestaged)
+				{
+					result = Activation::Apply(storage_path, plan, staging, GlobalProfiles.Settings().copy_threads, Probe::FirstTier(estimate.strategy), &journal);
+				}
+				else if (GlobalCapabilities.staging_links)
+				{
+					result = Activation::Stage(storage_path, plan, GlobalProfiles.Settings().exec_mods_folder_path, GlobalProfiles.Settings().copy_threads, Probe::FirstTier(estimate.strategy), &journal);
+				}
+				else
+				{
+					result = Activation::Apply(storage_path, plan, GlobalProfiles.Settings().exec_mods_folder_path, GlobalProfiles.Settings().copy_threads, Probe::FirstTier(estimate.strategy), &journal);
+				}
+				bool staging_failed = !result.copy.errors.empty();
+				result.copy.errors.insert(result.copy.errors.end(), errors.begin(), errors.end());
+
+				std::cout << result.removed << " mods removed, " << plan.unchanged_files << " mods (" << FormatBytes(plan.unchanged_bytes) << ") already in place and left untouched\n";
+				Utils::DisplayCopyReport(result.copy);
+
+				if (GlobalCapabilities.staging_links)
+				{
+					fs::path retired;
+					std::error_code ec = staging_failed ? std::make_error_code(std::errc::io_error) : Activation::SwapStaged(GlobalProfiles.Settings().exec_mods_folder_path, retired);
+					if (ec)
+					{
+						std::cout << "Cannot switch the mods folder (" << ec.message() << "), your current mods were left untouched.\n";
+						Utils::RemoveInBackground(Activation::SiblingPath(GlobalProfiles.Settings().exec_mods_folder_path, Activation::StagingSuffix));
+						journal.Commit();
+						return;
+					}
+					journal.Done(swap_id);
+					Utils::RemoveInBackground(retired);
+				}
+			}
+
+			Activation::InstallFile(profile.access_path + "\\" + ModListFilename, GlobalProfiles.Settings().exec_mods_folder_path + "\\..\\" + ModsListSettingsPath, use_links);
+			Utils::RecordModsFolder(profile.name, manifest);
+			journal.Commit();
+			LaunchGame(profile);
+		}
+
+		void LaunchGame(const Profile& profile)
+		{
+			History::RecordUse(GlobalHistory, profile.name);
+			History::Save(History::HistoryFileName, GlobalHistory);
 
 			system("start steam://rungameid/1086940");
 
 			std::cout << profile.name << " profile is now loaded ! Enjoy your game !\n";
 
+			// The folder retired by the switch is deleted while the game starts
+			// rather than left for the next start.
+			GlobalReclaimer.Drain(ReclaimAfterLaunchTimeout);
 			Leave();
 		}
 
@@ -234,7 +1099,7 @@ namespace
 			}
 
 			std::ostringstream oss;
-			oss << GlobalData.first.mods_storage_path << "\\" << profile_name;
+			oss << GlobalProfiles.Settings().mods_storage_path << "\\" << profile_name;
 			if (fs::exists(oss.str()))
 			{
 				std::cout << "This profile already exist !\n";
@@ -260,7 +1125,7 @@ namespace
 				return;
 			}
 
-			if (!fs::exists(GlobalData.first.exec_mods_folder_path))
+			if (!fs::exists(GlobalProfiles.Settings().exec_mods_folder_path))
 			{
 				std::cout << "Baldur's Gate 3 mods folder doesn't exist ! Setup your settings first.\n";
 				return;
@@ -282,9 +1147,13 @@ namespace
 		void UpdateExistingProfileFromCurrentMods()
 		{
 			Profile profile = Utils::ChooseProfile();
+			if (profile.name == InvalidProfileName)
+			{
+				return;
+			}
 
 			Utils::CopyCurrentMods(profile);
-			std::cout << "Mods copied from the current mods folder with success !\n";
+			std::cout << profile.name << " profile updated from the current mods folder !\n";
 		}
 
 
@@ -298,31 +1167,55 @@ namespace
 
 			std::cout << "Starting delete of " + profile.name << "\n";
 
-			if (fs::exists(profile.access_path))
+			// The folder is renamed away at once, its files are reclaimed in the background.
+			fs::path trashed;
+			if (std::error_code ec = Trash::MoveToTrash(profile.access_path, trashed); !ec)
 			{
-				fs::remove_all(profile.access_path);
-				fs::remove(profile.access_path);
+				GlobalReclaimer.Add(trashed);
+			}
+			else if (fs::exists(profile.access_path))
+			{
+				std::cout << "Cannot move the profile to the trash (" << ec.message() << "), deleting it now...\n";
+				for (const auto& [path, error] : BatchIo::RemoveTree(profile.access_path, GlobalProfiles.Settings().copy_threads))
+				{
+					std::cout << "\tFailed: " << path.string() << " : " << error.message() << "\n";
+				}
 			}
 			Utils::RemoveProfile(profile);
 
+			std::vector<BlobStore::Manifest> manifests;
+			for (const auto& remaining : GlobalProfiles.Profiles())
+			{
+				manifests.push_back(BlobStore::LoadManifest(remaining.access_path));
+			}
+			size_t reclaimed = BlobStore::CollectGarbage(GlobalProfiles.Settings().mods_storage_path, manifests);
+			if (reclaimed > 0)
+			{
+				std::cout << reclaimed << " unused mod files removed from the storage\n";
+			}
+
 			std::cout << "Profile " << profile.name << " deleted with success :\n";
 		}
 
 		void SetupSettings()
 		{
-			std::ifstream ifile(SettingFileName);
-			json parser;
-			ifile >> parser;
-			ifile.close();
-
-			parser[SettingsHolderName] = Utils::CreateSettings();
-
-
-			std::ofstream ofile(SettingFileName);
-			ofile << parser.dump(Indent);
-			ofile.close();
+			GlobalProfiles.SetSettings(Utils::CreateSettings(GlobalProfiles.Settings()));
+			Utils::LoadCapabilities(true);
+		}
 
-			Utils::CheckAndLoadProfile();
+		void FindModUsers()
+		{
+			std::cout << "Enter .pak names or paths, mod UUIDs or content hashes, one per line, and an empty line to search:\n";
+			std::vector<std::string> terms;
+			std::string line;
+			while (std::getline(std::cin, line) && !ModIndex::Fold(line).empty())
+			{
+				terms.push_back(line);
+			}
+			if (!terms.empty())
+			{
+				Utils::DisplayModUsers(terms);
+			}
 		}
 
 		void Leave()
@@ -335,17 +1228,34 @@ namespace
 	void MainLoop()
 	{
 		Utils::CheckAndLoadProfile();
+		Fingerprint::GlobalCache.Open(Fingerprint::CacheFileName);
+		Utils::ResumeJournal();
+		Utils::RecoverInterruptedSwitch();
+		Utils::ResumeReclaim();
+		Utils::FillProfileFingerprints();
+		Utils::SyncModIndex();
+		Utils::CheckModsFolder();
+		Utils::LoadCapabilities(false);
+		GlobalHistory = History::Load(History::HistoryFileName);
 		int choice = -1;
 		while (!LeaveProgram)
 		{
+			Utils::StartPrestage();
+
+			if (!GlobalActiveProfile.empty())
+			{
+				std::cout << "Currently active: " << GlobalActiveProfile << "\n";
+			}
 			std::cout << "1 - Select a Profile and launch the game\n"
 				<< "2 - Create a new empty Profile\n"
 				<< "3 - Create a new Profile from current mods folder\n"
 				<< "4 - Update Profile from the current mods folder\n"
 				<< "5 - Delete a Profile\n"
 				<< "6 - Setup Settings\n"
+				<< "7 - Find the profiles using a mod\n"
 				<< "0 - Leave\n";
-			choice = GetSecureNumericInput(0, 5);
+			choice = GetSecureNumericInput(0, 7);
+			GlobalPrestager.Cancel();
 			std::system("CLS");
 
 			switch (choice)
@@ -371,6 +1281,9 @@ namespace
 			case 6:
 				Commands::SetupSettings();
 				break;
+			case 7:
+				Commands::FindModUsers();
+				break;
 			default:
 				break;
 			}
@@ -378,6 +1291,11 @@ namespace
 			std::cout << "\n\n";
 		}
 
+		GlobalProfiles.Close();
+		if (size_t left = GlobalReclaimer.Stop(); left > 0)
+		{
+			std::cout << left << " deleted folders will be cleaned up on the next start.\n";
+		}
 	}
 
 
@@ -387,7 +1305,34 @@ namespace
 
 
 
-int main()
+int main(int argc, char* argv[])
 {
+	if (argc > 1 && std::string(argv[1]) == BenchHashArgument)
+	{
+		Utils::BenchmarkHash(argc > 2 ? fs::path(argv[2]) : fs::path());
+		return 0;
+	}
+	if (argc > 2 && std::string(argv[1]) == BenchIoArgument)
+	{
+		Utils::BenchmarkIo(argv[2]);
+		return 0;
+	}
+	if (argc > 1 && std::string(argv[1]) == ExportProfilesArgument)
+	{
+		Utils::OpenRegistry();
+		Utils::ExportProfiles(argc > 2 ? fs::path(argv[2]) : fs::path(ExportFileName));
+		GlobalProfiles.Close();
+		return 0;
+	}
+	if (argc > 2 && std::string(argv[1]) == WhoUsesArgument)
+	{
+		// Profiles captured or loaded since the last index update are indexed first.
+		Utils::OpenRegistry();
+		GlobalModUsage.Open(ModIndex::IndexFileName);
+		Utils::SyncModIndex();
+		Utils::DisplayModUsers(std::vector<std::string>(argv + 2, argv + argc));
+		GlobalProfiles.Close();
+		return 0;
+	}
 	MainLoop();
 }
\ No newline at end of file
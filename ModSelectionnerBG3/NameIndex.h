@@ -0,0 +1,172 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Search index over the profile names, for filtering the profile list as the
+// user types. Names are folded to lower case and kept sorted for prefix
+// queries, and every three-character sequence of a name maps to the sorted
+// list of names that contain it, so a longer query only checks the names
+// sharing all of its trigrams. Adding or removing a name only touches its own
+// entries.
+namespace NameIndex
+{
+	// Queries shorter than a trigram match the start of names only.
+	constexpr size_t TrigramLength = 3;
+
+	class Index
+	{
+	public:
+		void Clear()
+		{
+			names.clear();
+			folded.clear();
+			ids.clear();
+			prefixes.clear();
+			postings.clear();
+		}
+
+		void Add(const std::string& name)
+		{
+			if (ids.contains(name))
+			{
+				return;
+			}
+			uint32_t id = static_cast<uint32_t>(names.size());
+			ids[name] = id;
+			names.push_back(name);
+			folded.push_back(Fold(name));
+			prefixes.insert({ folded[id], id });
+			// Ids only grow, so appending keeps every list sorted.
+			for (uint32_t trigram : Trigrams(folded[id]))
+			{
+				postings[trigram].push_back(id);
+			}
+		}
+
+		void Remove(const std::string& name)
+		{
+			auto it = ids.find(name);
+			if (it == ids.end())
+			{
+				return;
+			}
+			uint32_t id = it->second;
+			ids.erase(it);
+			prefixes.erase({ folded[id], id });
+			for (uint32_t trigram : Trigrams(folded[id]))
+			{
+				auto posting = postings.find(trigram);
+				std::vector<uint32_t>& list = posting->second;
+				list.erase(std::lower_bound(list.begin(), list.end(), id));
+				if (list.empty())
+				{
+					postings.erase(posting);
+				}
+			}
+			// The slot stays so that ids keep their order.
+			names[id].clear();
+			folded[id].clear();
+		}
+
+		size_t Count() const
+		{
+			return ids.size();
+		}
+
+		const std::string& Name(uint32_t id) const
+		{
+			return names[id];
+		}
+
+		// Ids of the names containing query, ignoring case, in the order they were
+		// added. Queries shorter than TrigramLength match the start of names.
+		std::vector<uint32_t> Search(std::string_view query) const
+		{
+			std::vector<uint32_t> result;
+			std::string key = Fold(query);
+			if (key.empty())
+			{
+				result.reserve(ids.size());
+				for (uint32_t id = 0; id < names.size(); id++)
+				{
+					if (!folded[id].empty())
+					{
+						result.push_back(id);
+					}
+				}
+				return result;
+			}
+
+			if (key.size() < TrigramLength)
+			{
+				for (auto it = prefixes.lower_bound({ key, 0 }); it != prefixes.end() && it->first.starts_with(key); ++it)
+				{
+					result.push_back(it->second);
+				}
+				std::sort(result.begin(), result.end());
+				return result;
+			}
+
+			// Intersect the posting lists, shortest first.
+			std::vector<const std::vector<uint32_t>*> lists;
+			for (uint32_t trigram : Trigrams(key))
+			{
+				auto posting = postings.find(trigram);
+				if (posting == postings.end())
+				{
+					return result;
+				}
+				lists.push_back(&posting->second);
+			}
+			std::sort(lists.begin(), lists.end(), [](const auto* lhs, const auto* rhs) { return lhs->size() < rhs->size(); });
+
+			for (uint32_t id : *lists.front())
+			{
+				bool in_all = std::all_of(lists.begin() + 1, lists.end(), [&](const auto* list) { return std::binary_search(list->begin(), list->end(), id); });
+				// Sharing every trigram does not make a substring: check it.
+				if (in_all && folded[id].find(key) != std::string::npos)
+				{
+					result.push_back(id);
+				}
+			}
+			return result;
+		}
+
+	private:
+		static std::string Fold(std::string_view text)
+		{
+			std::string lower(text);
+			std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+			return lower;
+		}
+
+		// Distinct trigrams of text, each packed in an integer.
+		static std::vector<uint32_t> Trigrams(std::string_view text)
+		{
+			std::vector<uint32_t> trigrams;
+			for (size_t i = 0; i + TrigramLength <= text.size(); i++)
+			{
+				trigrams.push_back((static_cast<uint32_t>(static_cast<unsigned char>(text[i])) << 16)
+					| (static_cast<uint32_t>(static_cast<unsigned char>(text[i + 1])) << 8)
+					| static_cast<unsigned char>(text[i + 2]));
+			}
+			std::sort(trigrams.begin(), trigrams.end());
+			trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+			return trigrams;
+		}
+
+		// Indexed by id; emptied when the name is removed.
+		std::vector<std::string> names;
+		std::vector<std::string> folded;
+		std::unordered_map<std::string, uint32_t> ids;
+		std::set<std::pair<std::string, uint32_t>> prefixes;
+		std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+	};
+}
@@ -0,0 +1,198 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "CopyBackend.h"
+#include "Hash.h"
+
+namespace fs = std::filesystem;
+
+// Copies files while hashing them, reading every byte from disk once.
+// Three threads run the stages (read, hash, write) and pass fixed-size buffers
+// from a pool through bounded single-producer single-consumer queues:
+// reader -> hasher -> writer -> back to the reader. Memory stays at
+// BufferCount * BufferSize whatever the size of the files, and while a buffer
+// is being hashed the next ones are already being read and the previous ones written.
+namespace Pipeline
+{
+	constexpr size_t BufferSize = 4 << 20;
+	constexpr size_t BufferCount = 16;
+
+	// Lock-free ring between one producer and one consumer. Waiting on a full or
+	// empty ring blocks on the atomic itself instead of spinning.
+	template <typename T, size_t Capacity>
+	class SpscQueue
+	{
+		static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+	public:
+		void Push(const T& item)
+		{
+			size_t tail_index = tail.load(std::memory_order_relaxed);
+			for (size_t head_index = head.load(std::memory_order_acquire); tail_index - head_index == Capacity; head_index = head.load(std::memory_order_acquire))
+			{
+				head.wait(head_index, std::memory_order_acquire);
+			}
+			items[tail_index & (Capacity - 1)] = item;
+			tail.store(tail_index + 1, std::memory_order_release);
+			tail.notify_one();
+		}
+
+		T Pop()
+		{
+			size_t head_index = head.load(std::memory_order_relaxed);
+			for (size_t tail_index = tail.load(std::memory_order_acquire); tail_index == head_index; tail_index = tail.load(std::memory_order_acquire))
+			{
+				tail.wait(tail_index, std::memory_order_acquire);
+			}
+			T item = items[head_index & (Capacity - 1)];
+			head.store(head_index + 1, std::memory_order_release);
+			head.notify_one();
+			return item;
+		}
+
+	private:
+		T items[Capacity] = {};
+		alignas(64) std::atomic<size_t> head = 0;
+		alignas(64) std::atomic<size_t> tail = 0;
+	};
+
+	struct Item
+	{
+		fs::path source;
+		fs::path destination;
+	};
+
+	struct Outcome
+	{
+		uint64_t hash = 0;
+		std::error_code error;
+	};
+
+	// One buffer of one file travelling through the stages.
+	struct Chunk
+	{
+		size_t item = 0;
+		size_t buffer = 0;
+		DWORD length = 0;
+		bool first = false;
+		bool last = false;
+		int error = 0;
+	};
+
+	// Copies every item.source to item.destination and returns the content hash of each.
+	// Destinations get the modification time of their source. on_done runs on the
+	// writer thread as soon as an item is complete.
+	std::vector<Outcome> HashAndCopy(const std::vector<Item>& items, const std::function<void(size_t, const Outcome&)>& on_done = nullptr)
+	{
+		std::vector<Outcome> outcomes(items.size());
+		if (items.empty())
+		{
+			return outcomes;
+		}
+
+		std::unique_ptr<char[]> memory(new char[BufferSize * BufferCount]);
+		auto buffer_at = [&](size_t index) { return memory.get() + index * BufferSize; };
+
+		SpscQueue<size_t, BufferCount> free_buffers;
+		SpscQueue<Chunk, BufferCount> to_hash;
+		SpscQueue<Chunk, BufferCount> to_write;
+		for (size_t i = 0; i < BufferCount; i++)
+		{
+			free_buffers.Push(i);
+		}
+
+		std::jthread reader([&]()
+			{
+				for (size_t i = 0; i < items.size(); i++)
+				{
+					CopyBackend::FileHandle input(CreateFileW(items[i].source.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+					int open_error = input.IsValid() ? 0 : static_cast<int>(GetLastError());
+					for (bool first = true;; first = false)
+					{
+						Chunk chunk{ .item = i, .buffer = free_buffers.Pop(), .first = first, .error = open_error };
+						if (!open_error && !ReadFile(input.Get(), buffer_at(chunk.buffer), static_cast<DWORD>(BufferSize), &chunk.length, nullptr))
+						{
+							chunk.error = static_cast<int>(GetLastError());
+						}
+						chunk.last = chunk.error || chunk.length < BufferSize;
+						to_hash.Push(chunk);
+						if (chunk.last)
+						{
+							break;
+						}
+					}
+				}
+			});
+
+		std::jthread hasher_stage([&]()
+			{
+				Hash::Hasher hasher;
+				for (size_t done = 0; done < items.size();)
+				{
+					Chunk chunk = to_hash.Pop();
+					if (chunk.first)
+					{
+						hasher = Hash::Hasher();
+					}
+					hasher.Update(buffer_at(chunk.buffer), chunk.length);
+					if (chunk.last)
+					{
+						outcomes[chunk.item].hash = hasher.Final();
+						done++;
+					}
+					to_write.Push(chunk);
+				}
+			});
+
+		std::unique_ptr<CopyBackend::FileHandle> output;
+		std::error_code write_error;
+		for (size_t done = 0; done < items.size();)
+		{
+			Chunk chunk = to_write.Pop();
+			const Item& item = items[chunk.item];
+			if (chunk.first)
+			{
+				write_error = {};
+				output = std::make_unique<CopyBackend::FileHandle>(CreateFileW(item.destination.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+				if (!output->IsValid())
+				{
+					write_error = CopyBackend::LastError();
+				}
+			}
+
+			DWORD written = 0;
+			if (chunk.error)
+			{
+				write_error = std::error_code(chunk.error, std::system_category());
+			}
+			else if (!write_error && chunk.length > 0 && (!WriteFile(output->Get(), buffer_at(chunk.buffer), chunk.length, &written, nullptr) || written != chunk.length))
+			{
+				write_error = CopyBackend::LastError();
+			}
+			free_buffers.Push(chunk.buffer);
+
+			if (chunk.last)
+			{
+				output.reset();
+				if (!write_error)
+				{
+					write_error = CopyBackend::CopyMTime(item.source, item.destination);
+				}
+				outcomes[chunk.item].error = write_error;
+				if (on_done)
+				{
+					on_done(chunk.item, outcomes[chunk.item]);
+				}
+				done++;
+			}
+		}
+		return outcomes;
+	}
+}
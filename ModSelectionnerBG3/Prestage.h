@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <filesystem>
+#include <windows.h>
+#include "Activation.h"
+#include "BlobStore.h"
+#include "CopyBackend.h"
+
+namespace fs = std::filesystem;
+
+// Builds the predicted next profile in a hidden folder beside the Mods folder
+// while the menu waits for input, so that loading it only needs the final swap.
+// The work is throttled to a byte budget and stops as soon as it is cancelled.
+namespace Prestage
+{
+	constexpr const char* PrestageSuffix = ".prestage";
+	constexpr uintmax_t DefaultBytesPerSecond = 64ull << 20;
+	constexpr auto ThrottleSlice = std::chrono::milliseconds(50);
+
+	fs::path PrestagePath(const fs::path& folder)
+	{
+		return Activation::SiblingPath(folder, PrestageSuffix);
+	}
+
+	class Stager
+	{
+	public:
+		~Stager()
+		{
+			Cancel();
+		}
+
+		void Start(const fs::path& storage_path, const BlobStore::Manifest& manifest, const fs::path& folder, const std::string& profile_name, uintmax_t bytes_per_second)
+		{
+			Cancel();
+			target = profile_name;
+			complete = false;
+			seconds = 0.0;
+			files_copied = 0;
+			bytes_copied = 0;
+			worker = std::jthread([this, storage_path, manifest, folder, bytes_per_second](std::stop_token stop)
+				{
+					Run(stop, storage_path, manifest, folder, bytes_per_second);
+				});
+		}
+
+		void Cancel()
+		{
+			if (worker.joinable())
+			{
+				worker.request_stop();
+				worker.join();
+			}
+		}
+
+		// Forgets the staged profile once its folder was used or discarded.
+		void Reset()
+		{
+			Cancel();
+			target.clear();
+		}
+
+		const std::string& Target() const { return target; }
+		bool Complete() const { return complete; }
+		double Seconds() const { return seconds; }
+		// What was copied rather than linked or cloned, which the switch no longer has to copy.
+		size_t FilesCopied() const { return files_copied; }
+		uintmax_t BytesCopied() const { return bytes_copied; }
+
+	private:
+		void Run(std::stop_token stop, const fs::path& storage_path, const BlobStore::Manifest& manifest, const fs::path& folder, uintmax_t bytes_per_second)
+		{
+			auto start = std::chrono::steady_clock::now();
+			auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+			try
+			{
+				fs::path prestage = PrestagePath(folder);
+				fs::create_directories(prestage);
+				SetFileAttributesW(prestage.c_str(), FILE_ATTRIBUTE_HIDDEN);
+
+				// A prestage left by an earlier run is updated, not rebuilt.
+				Activation::Plan plan = Activation::BuildPlan(manifest, prestage, false);
+				for (const auto& path : plan.to_remove)
+				{
+					if (stop.stop_requested())
+					{
+						return;
+					}
+					CopyBackend::RemoveFile(path);
+				}
+
+				for (const auto& entry : plan.to_add)
+				{
+					if (stop.stop_requested())
+					{
+						seconds = elapsed();
+						return;
+					}
+
+					fs::path destination = prestage / Scanner::PathOf(entry.name);
+					std::error_code ec;
+					fs::create_directories(destination.parent_path(), ec);
+					CopyBackend::Result result = CopyBackend::CopyWithBestTier(BlobStore::BlobPath(storage_path, entry), destination, entry.size, CopyBackend::Tier::Link);
+					if (result.tier == CopyBackend::Tier::Link || result.tier == CopyBackend::Tier::Clone)
+					{
+						continue;
+					}
+
+					files_copied++;
+					bytes_copied += entry.size;
+					double budget_seconds = static_cast<double>(bytes_copied) / bytes_per_second;
+					while (elapsed() < budget_seconds && !stop.stop_requested())
+					{
+						std::this_thread::sleep_for(ThrottleSlice);
+					}
+				}
+				complete = !stop.stop_requested();
+			}
+			catch (const std::exception&)
+			{
+				complete = false;
+			}
+			seconds = elapsed();
+		}
+
+		std::jthread worker;
+		std::string target;
+		std::atomic<bool> complete = false;
+		std::atomic<double> seconds = 0.0;
+		std::atomic<size_t> files_copied = 0;
+		std::atomic<uintmax_t> bytes_copied = 0;
+	};
+}
@@ -0,0 +1,244 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "CopyBackend.h"
+#include "Links.h"
+#include "JSON/json.hpp"
+
+namespace fs = std::filesystem;
+
+// Measures what the mods folder and the profile storage can do, and turns it
+// into a per-switch choice of strategy with an estimated duration.
+// Results are cached next to Profile.ini and refreshed from the settings menu.
+namespace Probe
+{
+	constexpr const char* CapabilitiesFileName = "Capabilities.ini";
+	constexpr const char* ProbeFileName = ".probe";
+	constexpr uintmax_t ThroughputSampleSize = 64ull << 20;
+
+	// Fixed per-file costs of the metadata-only operations, in seconds.
+	constexpr double JunctionCost = 0.01;
+	constexpr double LinkCostPerFile = 0.0002;
+	constexpr double CloneCostPerFile = 0.0005;
+	constexpr double CopyCostPerFile = 0.001;
+	constexpr double DefaultThroughput = 100.0 * (1 << 20);
+
+	enum class Strategy
+	{
+		Junction,
+		HardLink,
+		Clone,
+		Copy,
+	};
+
+	constexpr const char* StrategyNames[] = { "junction", "hard links", "block clones", "parallel copy" };
+
+	struct Capabilities
+	{
+		std::string exec_mods_folder_path;
+		std::string mods_storage_path;
+		// Until a probe succeeds every cheap tier is assumed to work; the copy
+		// backend falls back by itself when one does not.
+		bool same_volume = true;
+		bool hard_links = true;
+		// Hard links inside the volume of the Mods folder, all that staging needs.
+		bool staging_links = true;
+		bool block_clone = false;
+		bool junctions = true;
+		double copy_throughput = DefaultThroughput;
+	};
+
+	NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(Capabilities, exec_mods_folder_path, mods_storage_path, same_volume, hard_links, staging_links, block_clone, junctions, copy_throughput)
+
+	struct Estimate
+	{
+		Strategy strategy = Strategy::Copy;
+		double seconds = 0.0;
+	};
+
+	std::wstring VolumeOf(const fs::path& path)
+	{
+		wchar_t volume[MAX_PATH] = {};
+		if (!GetVolumePathNameW(path.c_str(), volume, MAX_PATH))
+		{
+			return {};
+		}
+		return volume;
+	}
+
+	// Every capability is checked by doing the real operation between the two
+	// folders, so unusual setups (network shares, FAT drives) are detected too.
+	Capabilities Run(const fs::path& mods_folder, const fs::path& storage_path)
+	{
+		Capabilities capabilities{ .exec_mods_folder_path = mods_folder.string(), .mods_storage_path = storage_path.string() };
+
+		fs::path mods_parent = mods_folder.parent_path();
+		std::wstring mods_volume = VolumeOf(mods_parent);
+		capabilities.same_volume = !mods_volume.empty() && mods_volume == VolumeOf(storage_path);
+
+		std::error_code ec;
+		fs::path sample = storage_path / ProbeFileName;
+		fs::path linked = mods_parent / ProbeFileName;
+		fs::path cloned = mods_parent / (std::string(ProbeFileName) + ".clone");
+		fs::path junction = mods_parent / (std::string(ProbeFileName) + ".junction");
+		fs::path staged = mods_parent / (std::string(ProbeFileName) + ".staged");
+		fs::remove(sample, ec);
+		fs::remove(linked, ec);
+		fs::remove(cloned, ec);
+		fs::remove(staged, ec);
+		if (Links::IsLink(junction))
+		{
+			Links::RemoveLink(junction);
+		}
+
+		{
+			std::ofstream file(sample, std::ios::binary);
+			std::vector<char> block(1 << 20, 'p');
+			for (uintmax_t written = 0; written < ThroughputSampleSize && file; written += block.size())
+			{
+				file.write(block.data(), block.size());
+			}
+		}
+
+		fs::create_hard_link(sample, linked, ec);
+		capabilities.hard_links = !ec;
+		fs::remove(linked, ec);
+
+		// The storage may be on another drive while the Mods folder still links to its siblings.
+		std::ofstream(linked, std::ios::binary) << 'p';
+		fs::create_hard_link(linked, staged, ec);
+		capabilities.staging_links = !ec;
+		fs::remove(staged, ec);
+		fs::remove(linked, ec);
+
+		capabilities.block_clone = !CopyBackend::CloneFile(sample, cloned, ThroughputSampleSize);
+		fs::remove(cloned, ec);
+
+		capabilities.junctions = !Links::CreateJunction(junction, storage_path);
+		if (capabilities.junctions)
+		{
+			Links::RemoveLink(junction);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		if (!CopyBackend::BufferedCopy(sample, linked, ThroughputSampleSize))
+		{
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (seconds > 0.0)
+			{
+				capabilities.copy_throughput = static_cast<double>(ThroughputSampleSize) / seconds;
+			}
+		}
+		fs::remove(linked, ec);
+		fs::remove(sample, ec);
+
+		return capabilities;
+	}
+
+	void Save(const fs::path& cache_path, const Capabilities& capabilities)
+	{
+		std::ofstream file(cache_path);
+		file << nlohmann::json(capabilities).dump(4);
+	}
+
+	// Returns the cached capabilities, probing again when forced or when the cache
+	// was made for other folders.
+	Capabilities LoadOrRun(const fs::path& cache_path, const fs::path& mods_folder, const fs::path& storage_path, bool force)
+	{
+		if (!force && fs::exists(cache_path))
+		{
+			try
+			{
+				std::ifstream file(cache_path);
+				nlohmann::json parser;
+				file >> parser;
+				Capabilities cached = parser.get<Capabilities>();
+				if (cached.exec_mods_folder_path == mods_folder.string() && cached.mods_storage_path == storage_path.string())
+				{
+					return cached;
+				}
+			}
+			catch (const nlohmann::json::exception& e)
+			{
+				std::cerr << "Erreur: " << e.what() << std::endl;
+			}
+		}
+
+		if (!fs::exists(mods_folder.parent_path()) || !fs::exists(storage_path))
+		{
+			return Capabilities{};
+		}
+
+		std::cout << "Probing the mods and storage folders...\n";
+		Capabilities capabilities = Run(mods_folder, storage_path);
+		Save(cache_path, capabilities);
+		return capabilities;
+	}
+
+	CopyBackend::Tier FirstTier(Strategy strategy)
+	{
+		switch (strategy)
+		{
+		case Strategy::HardLink:
+			return CopyBackend::Tier::Link;
+		case Strategy::Clone:
+			return CopyBackend::Tier::Clone;
+		default:
+			return CopyBackend::Tier::Kernel;
+		}
+	}
+
+	double EstimateSeconds(const Capabilities& capabilities, Strategy strategy, size_t files, uintmax_t bytes)
+	{
+		switch (strategy)
+		{
+		case Strategy::Junction:
+			return JunctionCost;
+		case Strategy::HardLink:
+			return files * LinkCostPerFile;
+		case Strategy::Clone:
+			return files * CloneCostPerFile;
+		default:
+			return files * CopyCostPerFile + static_cast<double>(bytes) / capabilities.copy_throughput;
+		}
+	}
+
+	// Picks the cheapest strategy available for a switch that adds files / bytes.
+	// The junction is only used when the user opted into it, because it changes
+	// what the Mods folder is, and then always wins.
+	Estimate Choose(const Capabilities& capabilities, bool allow_junction, size_t files, uintmax_t bytes)
+	{
+		if (allow_junction && capabilities.junctions)
+		{
+			return { Strategy::Junction, JunctionCost };
+		}
+
+		std::vector<Strategy> candidates = { Strategy::Copy };
+		if (capabilities.same_volume && capabilities.block_clone)
+		{
+			candidates.push_back(Strategy::Clone);
+		}
+		if (capabilities.same_volume && capabilities.hard_links)
+		{
+			candidates.push_back(Strategy::HardLink);
+		}
+
+		Estimate best{ Strategy::Copy, EstimateSeconds(capabilities, Strategy::Copy, files, bytes) };
+		for (Strategy strategy : candidates)
+		{
+			double seconds = EstimateSeconds(capabilities, strategy, files, bytes);
+			if (seconds < best.seconds)
+			{
+				best = { strategy, seconds };
+			}
+		}
+		return best;
+	}
+}
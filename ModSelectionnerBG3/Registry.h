@@ -0,0 +1,492 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "Hash.h"
+
+namespace fs = std::filesystem;
+
+// Binary log of the settings and profile records.
+// The file is a header followed by records appended one after the other, each
+// with its kind, length and a checksum of its payload, and is memory-mapped.
+// Nothing already written is modified: adding a record appends it, removing
+// one appends a removal naming its offset, and a batch of both is published by
+// a single header write, so a change costs its own few hundred bytes. Opening
+// the file replays it: the live records left by the last compaction, then the
+// log of changes since. A record torn by a crash fails its checksum and is
+// dropped with everything after it. Once removed records and removals pass
+// CompactionThreshold, the live records are rewritten to a new file.
+namespace Registry
+{
+	constexpr const char* RegistryFileName = "Profiles.registry";
+	constexpr uint32_t RegistryMagic = 0x47455250;
+	constexpr uint32_t RegistryVersion = 1;
+	constexpr uint64_t InitialCapacity = 64 << 10;
+	constexpr uint64_t CompactionThreshold = 256 << 10;
+
+	enum class Kind : uint32_t
+	{
+		Settings = 1,
+		Profile = 2,
+		// The payload is the offset of the removed record.
+		Removal = 3,
+	};
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		// Bytes of header and records in use; the rest of the file is free.
+		uint64_t used;
+	};
+
+	struct RecordHeader
+	{
+		uint32_t kind;
+		uint32_t length;
+		// Hash of the payload.
+		uint64_t checksum;
+	};
+
+	struct Record
+	{
+		Kind kind;
+		uint64_t offset;
+		// Points into the mapping: valid until the next change.
+		std::string_view payload;
+	};
+
+	// Length-prefixed fields of a record payload.
+	class Encoder
+	{
+	public:
+		void Uint(uint64_t value)
+		{
+			bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+
+		void String(std::string_view value)
+		{
+			Uint(value.size());
+			bytes.append(value);
+		}
+
+		const std::string& Bytes() const { return bytes; }
+
+	private:
+		std::string bytes;
+	};
+
+	class Decoder
+	{
+	public:
+		explicit Decoder(std::string_view bytes) : bytes(bytes) {}
+
+		bool Uint(uint64_t& value)
+		{
+			if (bytes.size() < sizeof(value))
+			{
+				return false;
+			}
+			std::memcpy(&value, bytes.data(), sizeof(value));
+			bytes.remove_prefix(sizeof(value));
+			return true;
+		}
+
+		bool String(std::string& value)
+		{
+			uint64_t length = 0;
+			if (!Uint(length) || bytes.size() < length)
+			{
+				return false;
+			}
+			value.assign(bytes.substr(0, static_cast<size_t>(length)));
+			bytes.remove_prefix(static_cast<size_t>(length));
+			return true;
+		}
+
+	private:
+		std::string_view bytes;
+	};
+
+	class Store
+	{
+	public:
+		Store() = default;
+		~Store()
+		{
+			Close();
+		}
+
+		Store(const Store&) = delete;
+		Store& operator=(const Store&) = delete;
+
+		// Maps the registry, creating an empty one when it is missing or unreadable.
+		bool Open(const fs::path& registry_path)
+		{
+			Close();
+			path = registry_path;
+			return Load();
+		}
+
+		void Close()
+		{
+			Unmap();
+			if (file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(file);
+				file = INVALID_HANDLE_VALUE;
+			}
+		}
+
+		bool IsOpen() const
+		{
+			return header != nullptr;
+		}
+
+		// Live records, in the order they were appended.
+		std::vector<Record> Records() const
+		{
+			std::vector<Record> records;
+			for (uint64_t offset = sizeof(Header); header && offset < header->used; offset += RecordSize(offset))
+			{
+				Kind kind = static_cast<Kind>(RecordAt(offset)->kind);
+				if ((kind == Kind::Settings || kind == Kind::Profile) && !removed.contains(offset))
+				{
+					records.push_back({ kind, offset, Payload(offset) });
+				}
+			}
+			return records;
+		}
+
+		// Writes a record after the last one and returns its offset, 0 on failure.
+		uint64_t Append(Kind kind, std::string_view payload)
+		{
+			std::vector<uint64_t> offsets = Commit({ { kind, std::string(payload) } }, {});
+			return offsets.empty() ? 0 : offsets.front();
+		}
+
+		void Remove(uint64_t offset)
+		{
+			Commit({}, { offset });
+		}
+
+		// Appends the new records, then a removal for each of removals, and
+		// publishes them with a single header write: a crash keeps the whole batch
+		// or none of it. Returns the offsets of the new records, or nothing when
+		// the file could not grow.
+		std::vector<uint64_t> Commit(const std::vector<std::pair<Kind, std::string>>& appends, const std::vector<uint64_t>& removals)
+		{
+			std::vector<uint64_t> offsets;
+			if (!header)
+			{
+				return offsets;
+			}
+
+			std::vector<std::pair<Kind, std::string>> batch = appends;
+			std::vector<uint64_t> removing;
+			for (uint64_t removal : removals)
+			{
+				if (IsLive(removal))
+				{
+					Encoder encoder;
+					encoder.Uint(removal);
+					batch.push_back({ Kind::Removal, encoder.Bytes() });
+					removing.push_back(removal);
+				}
+			}
+
+			if (batch.empty())
+			{
+				return offsets;
+			}
+
+			uint64_t first = header->used;
+			uint64_t needed = first;
+			for (const auto& [kind, payload] : batch)
+			{
+				needed += sizeof(RecordHeader) + payload.size();
+			}
+			if (needed > capacity)
+			{
+				uint64_t new_capacity = std::max(capacity, InitialCapacity);
+				while (new_capacity < needed)
+				{
+					new_capacity *= 2;
+				}
+				Unmap();
+				if (!Map(new_capacity))
+				{
+					return offsets;
+				}
+			}
+
+			uint64_t offset = first;
+			for (const auto& [kind, payload] : batch)
+			{
+				RecordHeader record{ static_cast<uint32_t>(kind), static_cast<uint32_t>(payload.size()), Checksum(payload) };
+				std::memcpy(base + offset, &record, sizeof(record));
+				std::memcpy(base + offset + sizeof(record), payload.data(), payload.size());
+				if (kind == Kind::Removal)
+				{
+					dead_bytes += sizeof(record) + payload.size();
+				}
+				else
+				{
+					offsets.push_back(offset);
+				}
+				offset += sizeof(record) + payload.size();
+			}
+			FlushViewOfFile(base + first, static_cast<SIZE_T>(needed - first));
+			header->used = needed;
+			FlushViewOfFile(header, sizeof(Header));
+			compaction_failed = false;
+
+			for (uint64_t removal : removing)
+			{
+				removed.insert(removal);
+				dead_bytes += RecordSize(removal);
+			}
+			return offsets;
+		}
+
+		// True once removed records and removals take CompactionThreshold bytes.
+		// After a failed compaction, not again until the next commit.
+		bool ShouldCompact() const
+		{
+			return dead_bytes >= CompactionThreshold && !compaction_failed;
+		}
+
+		// A compaction runs in three steps, so that only the first and the last
+		// need the store to themselves: the live records are copied out, written
+		// beside the registry, then the copy is renamed over it.
+		struct Compaction
+		{
+			fs::path temp;
+			std::string bytes;
+			// Header::used when the records were copied.
+			uint64_t used = 0;
+		};
+
+		Compaction PrepareCompaction() const
+		{
+			Compaction compaction{ .temp = path, .used = header ? header->used : 0 };
+			compaction.temp += ".tmp";
+			std::vector<Record> records = Records();
+			Header new_header{ RegistryMagic, RegistryVersion, sizeof(Header) };
+			for (const auto& record : records)
+			{
+				new_header.used += sizeof(RecordHeader) + record.payload.size();
+			}
+			compaction.bytes.reserve(static_cast<size_t>(new_header.used));
+			compaction.bytes.append(reinterpret_cast<const char*>(&new_header), sizeof(new_header));
+			for (const auto& record : records)
+			{
+				compaction.bytes.append(reinterpret_cast<const char*>(RecordAt(record.offset)), sizeof(RecordHeader) + record.payload.size());
+			}
+			return compaction;
+		}
+
+		// Touches nothing of the store: runs without its lock.
+		static bool WriteCompaction(const Compaction& compaction)
+		{
+			std::ofstream output(compaction.temp, std::ios::binary | std::ios::trunc);
+			output.write(compaction.bytes.data(), static_cast<std::streamsize>(compaction.bytes.size()));
+			output.close();
+			if (!output)
+			{
+				std::error_code ec;
+				fs::remove(compaction.temp, ec);
+				return false;
+			}
+			return true;
+		}
+
+		// Renames the written copy over the registry. Offsets change: read them
+		// again from Records. A copy made before the last commit is dropped, and
+		// is made again on the next call. On failure the registry is left as it was.
+		bool FinishCompaction(const Compaction& compaction, bool written)
+		{
+			std::error_code ec;
+			if (!written)
+			{
+				compaction_failed = true;
+				return false;
+			}
+			if (!header || header->used != compaction.used)
+			{
+				fs::remove(compaction.temp, ec);
+				return false;
+			}
+
+			Close();
+			fs::rename(compaction.temp, path, ec);
+			if (ec)
+			{
+				fs::remove(compaction.temp, ec);
+				compaction_failed = true;
+				Load();
+				return false;
+			}
+			return Load();
+		}
+
+	private:
+		// Maps the file at path and replays its records.
+		bool Load()
+		{
+			if (!OpenFile())
+			{
+				return false;
+			}
+
+			LARGE_INTEGER file_size{};
+			GetFileSizeEx(file, &file_size);
+			uint64_t capacity = static_cast<uint64_t>(file_size.QuadPart);
+			bool valid = capacity >= sizeof(Header) && Map(capacity)
+				&& header->magic == RegistryMagic && header->version == RegistryVersion
+				&& header->used >= sizeof(Header) && header->used <= capacity;
+			if (!valid)
+			{
+				return Reset();
+			}
+
+			// Stops at a torn tail, which the next change overwrites.
+			removed.clear();
+			dead_bytes = 0;
+			std::unordered_set<uint64_t> starts;
+			uint64_t offset = sizeof(Header);
+			while (offset < header->used)
+			{
+				const RecordHeader* record = RecordAt(offset);
+				if (header->used - offset < sizeof(RecordHeader) || header->used - offset - sizeof(RecordHeader) < record->length
+					|| Checksum(Payload(offset)) != record->checksum)
+				{
+					break;
+				}
+
+				uint64_t target = 0;
+				if (record->kind == static_cast<uint32_t>(Kind::Removal) && Decoder(Payload(offset)).Uint(target)
+					&& starts.contains(target) && removed.insert(target).second)
+				{
+					dead_bytes += RecordSize(offset) + RecordSize(target);
+				}
+				starts.insert(offset);
+				offset += RecordSize(offset);
+			}
+			header->used = offset;
+			return true;
+		}
+
+		static uint64_t Checksum(std::string_view payload)
+		{
+			Hash::Hasher hasher;
+			hasher.Update(payload.data(), payload.size());
+			return hasher.Final();
+		}
+
+		RecordHeader* RecordAt(uint64_t offset) const
+		{
+			return reinterpret_cast<RecordHeader*>(base + offset);
+		}
+
+		uint64_t RecordSize(uint64_t offset) const
+		{
+			return sizeof(RecordHeader) + RecordAt(offset)->length;
+		}
+
+		// True when offset starts a settings or profile record not removed yet.
+		// Only called with offsets returned by Commit or Records.
+		bool IsLive(uint64_t offset) const
+		{
+			if (offset < sizeof(Header) || offset >= header->used || removed.contains(offset))
+			{
+				return false;
+			}
+			Kind kind = static_cast<Kind>(RecordAt(offset)->kind);
+			return kind == Kind::Settings || kind == Kind::Profile;
+		}
+
+		std::string_view Payload(uint64_t offset) const
+		{
+			return std::string_view(base + offset + sizeof(RecordHeader), RecordAt(offset)->length);
+		}
+
+		bool OpenFile()
+		{
+			file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			return file != INVALID_HANDLE_VALUE;
+		}
+
+		// Maps the first new_capacity bytes of the file, growing it if needed.
+		bool Map(uint64_t new_capacity)
+		{
+			mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(new_capacity >> 32), static_cast<DWORD>(new_capacity), nullptr);
+			void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(new_capacity)) : nullptr;
+			if (!view)
+			{
+				Unmap();
+				return false;
+			}
+			base = static_cast<char*>(view);
+			header = reinterpret_cast<Header*>(base);
+			capacity = new_capacity;
+			return true;
+		}
+
+		void Unmap()
+		{
+			if (base)
+			{
+				UnmapViewOfFile(base);
+				base = nullptr;
+				header = nullptr;
+				capacity = 0;
+			}
+			if (mapping)
+			{
+				CloseHandle(mapping);
+				mapping = nullptr;
+			}
+		}
+
+		// Starts over with an empty registry. The magic is written last.
+		bool Reset()
+		{
+			Unmap();
+			LARGE_INTEGER zero{};
+			if (!SetFilePointerEx(file, zero, nullptr, FILE_BEGIN) || !SetEndOfFile(file) || !Map(InitialCapacity))
+			{
+				Close();
+				return false;
+			}
+			header->version = RegistryVersion;
+			header->used = sizeof(Header);
+			header->magic = RegistryMagic;
+			FlushViewOfFile(header, sizeof(Header));
+			removed.clear();
+			dead_bytes = 0;
+			return true;
+		}
+
+		fs::path path;
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+		char* base = nullptr;
+		Header* header = nullptr;
+		uint64_t capacity = 0;
+		// Offsets of the records named by a removal.
+		std::unordered_set<uint64_t> removed;
+		uint64_t dead_bytes = 0;
+		bool compaction_failed = false;
+	};
+}
@@ -0,0 +1,396 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <filesystem>
+#include "Registry.h"
+
+namespace fs = std::filesystem;
+
+// Settings and profiles held in memory, with the registry behind them.
+// Profiles are indexed by name, and every change is applied to memory at once
+// and only marked dirty. A background thread writes the dirty records to the
+// registry once no change came for FlushDelay, as a single commit, so a burst
+// of changes costs one write. Codec turns settings and profiles into record
+// payloads and back; profile records start with the rank of the profile in
+// the list, so a profile rewritten at the end of the file keeps its place.
+namespace Repository
+{
+	constexpr auto FlushDelay = std::chrono::milliseconds(500);
+
+	template <typename SettingsType, typename ProfileType, typename Codec>
+	class ProfileRepository
+	{
+	public:
+		ProfileRepository() = default;
+		~ProfileRepository()
+		{
+			Close();
+		}
+
+		ProfileRepository(const ProfileRepository&) = delete;
+		ProfileRepository& operator=(const ProfileRepository&) = delete;
+
+		// Maps the registry and loads it. A profile recorded twice keeps its last
+		// copy. A compaction left due by the last run is handed to the flush thread.
+		bool Open(const fs::path& path)
+		{
+			Close();
+			std::lock_guard lock(mutex);
+			settings = {};
+			has_settings = false;
+			profiles.clear();
+			ranks.clear();
+			by_name.clear();
+			next_rank = 0;
+			if (!store.Open(path))
+			{
+				return false;
+			}
+
+			std::unordered_map<std::string, std::pair<uint64_t, ProfileType>> loaded;
+			for (const auto& record : store.Records())
+			{
+				uint64_t rank = 0;
+				ProfileType profile;
+				if (record.kind == Registry::Kind::Settings && Codec::Decode(record.payload, settings))
+				{
+					has_settings = true;
+				}
+				else if (record.kind == Registry::Kind::Profile && DecodeProfile(record.payload, rank, profile))
+				{
+					std::string name = profile.name;
+					loaded[name] = { rank, std::move(profile) };
+				}
+			}
+
+			std::vector<std::pair<uint64_t, ProfileType>> ranked;
+			for (auto& [name, entry] : loaded)
+			{
+				ranked.push_back(std::move(entry));
+			}
+			std::sort(ranked.begin(), ranked.end(), [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+			for (auto& [rank, profile] : ranked)
+			{
+				by_name[profile.name] = profiles.size();
+				ranks.push_back(rank);
+				profiles.push_back(std::move(profile));
+				next_rank = rank + 1;
+			}
+			ReadOffsets();
+			if (store.ShouldCompact())
+			{
+				Schedule();
+			}
+			return true;
+		}
+
+		// Writes what is still dirty and unmaps the registry.
+		void Close()
+		{
+			if (worker.joinable())
+			{
+				worker.request_stop();
+				worker.join();
+			}
+			std::lock_guard lock(mutex);
+			Write();
+			store.Close();
+		}
+
+		bool HasSettings() const
+		{
+			return has_settings;
+		}
+
+		const SettingsType& Settings() const
+		{
+			return settings;
+		}
+
+		// In the order they were added.
+		const std::vector<ProfileType>& Profiles() const
+		{
+			return profiles;
+		}
+
+		const ProfileType* Find(const std::string& name) const
+		{
+			auto it = by_name.find(name);
+			return it != by_name.end() ? &profiles[it->second] : nullptr;
+		}
+
+		void SetSettings(const SettingsType& new_settings)
+		{
+			std::lock_guard lock(mutex);
+			settings = new_settings;
+			has_settings = true;
+			settings_dirty = true;
+			Schedule();
+		}
+
+		// Returns false when a profile already has that name.
+		bool Add(const ProfileType& profile)
+		{
+			std::lock_guard lock(mutex);
+			if (by_name.contains(profile.name))
+			{
+				return false;
+			}
+			by_name[profile.name] = profiles.size();
+			ranks.push_back(next_rank++);
+			profiles.push_back(profile);
+			dirty.insert(profile.name);
+			Schedule();
+			return true;
+		}
+
+		// Replaces the profile with the same name.
+		bool Update(const ProfileType& profile)
+		{
+			std::lock_guard lock(mutex);
+			auto it = by_name.find(profile.name);
+			if (it == by_name.end())
+			{
+				return false;
+			}
+			profiles[it->second] = profile;
+			dirty.insert(profile.name);
+			Schedule();
+			return true;
+		}
+
+		bool Remove(const std::string& name)
+		{
+			std::lock_guard lock(mutex);
+			auto it = by_name.find(name);
+			if (it == by_name.end())
+			{
+				return false;
+			}
+			size_t index = it->second;
+			by_name.erase(it);
+			profiles.erase(profiles.begin() + index);
+			ranks.erase(ranks.begin() + index);
+			for (size_t i = index; i < profiles.size(); i++)
+			{
+				by_name[profiles[i].name] = i;
+			}
+			dirty.insert(name);
+			Schedule();
+			return true;
+		}
+
+		// Replaces the whole registry content. The removal of every old record and
+		// the new records go in one commit, so a crash keeps either content whole.
+		void Import(const SettingsType& new_settings, const std::vector<ProfileType>& new_profiles)
+		{
+			std::lock_guard lock(mutex);
+			for (const auto& [name, offset] : offsets)
+			{
+				dirty.insert(name);
+			}
+			settings = new_settings;
+			has_settings = true;
+			settings_dirty = true;
+			profiles.clear();
+			ranks.clear();
+			by_name.clear();
+			next_rank = 0;
+			for (const auto& profile : new_profiles)
+			{
+				if (by_name.try_emplace(profile.name, profiles.size()).second)
+				{
+					ranks.push_back(next_rank++);
+					profiles.push_back(profile);
+					dirty.insert(profile.name);
+				}
+			}
+			Write();
+		}
+
+		// Writes what is dirty now instead of waiting for the flush thread.
+		void Flush()
+		{
+			std::lock_guard lock(mutex);
+			Write();
+		}
+
+	private:
+		// Caller holds the mutex.
+		void Schedule()
+		{
+			deadline = std::chrono::steady_clock::now() + FlushDelay;
+			if (!worker.joinable())
+			{
+				worker = std::jthread([this](std::stop_token stop) { Run(stop); });
+			}
+			ready.notify_one();
+		}
+
+		void Run(std::stop_token stop)
+		{
+			std::unique_lock lock(mutex);
+			for (;;)
+			{
+				if (!ready.wait(lock, stop, [this]() { return settings_dirty || !dirty.empty() || store.ShouldCompact(); }))
+				{
+					return;
+				}
+				// Each change pushes the deadline back.
+				while (std::chrono::steady_clock::now() < deadline)
+				{
+					ready.wait_until(lock, stop, deadline, []() { return false; });
+					if (stop.stop_requested())
+					{
+						return;
+					}
+				}
+				Write();
+				// The compacted copy is written without the lock, so that the menu
+				// only waits for the records to be copied and for the rename. After
+				// a failure, the store holds off until the next commit.
+				if (store.ShouldCompact())
+				{
+					Registry::Store::Compaction compaction = store.PrepareCompaction();
+					lock.unlock();
+					bool written = Registry::Store::WriteCompaction(compaction);
+					lock.lock();
+					if (store.FinishCompaction(compaction, written))
+					{
+						ReadOffsets();
+					}
+				}
+			}
+		}
+
+		// Commits the dirty records: their new copies and the removals of the old
+		// ones are appended as one batch. Caller holds the mutex.
+		void Write()
+		{
+			if (!store.IsOpen() || (!settings_dirty && dirty.empty()))
+			{
+				return;
+			}
+
+			std::vector<std::pair<Registry::Kind, std::string>> appends;
+			std::vector<uint64_t> removals;
+			std::vector<std::string> written;
+			if (settings_dirty)
+			{
+				appends.push_back({ Registry::Kind::Settings, Codec::Encode(settings) });
+				if (settings_offset)
+				{
+					removals.push_back(settings_offset);
+				}
+			}
+			for (const auto& name : dirty)
+			{
+				auto offset = offsets.find(name);
+				if (offset != offsets.end())
+				{
+					removals.push_back(offset->second);
+				}
+				auto it = by_name.find(name);
+				if (it != by_name.end())
+				{
+					appends.push_back({ Registry::Kind::Profile, EncodeProfile(ranks[it->second], profiles[it->second]) });
+					written.push_back(name);
+				}
+			}
+
+			std::vector<uint64_t> new_offsets = store.Commit(appends, removals);
+			if (new_offsets.size() != appends.size())
+			{
+				// Left dirty for the next flush.
+				return;
+			}
+
+			size_t next = 0;
+			if (settings_dirty)
+			{
+				settings_offset = new_offsets[next++];
+			}
+			for (const auto& name : dirty)
+			{
+				offsets.erase(name);
+			}
+			for (const auto& name : written)
+			{
+				offsets[name] = new_offsets[next++];
+			}
+			settings_dirty = false;
+			dirty.clear();
+		}
+
+		static std::string EncodeProfile(uint64_t rank, const ProfileType& profile)
+		{
+			Registry::Encoder encoder;
+			encoder.Uint(rank);
+			return encoder.Bytes() + Codec::Encode(profile);
+		}
+
+		static bool DecodeProfile(std::string_view payload, uint64_t& rank, ProfileType& profile)
+		{
+			Registry::Decoder decoder(payload);
+			return decoder.Uint(rank) && Codec::Decode(payload.substr(sizeof(rank)), profile);
+		}
+
+		// Caller holds the mutex.
+		void ReadOffsets()
+		{
+			settings_offset = 0;
+			offsets.clear();
+			for (const auto& record : store.Records())
+			{
+				uint64_t rank = 0;
+				ProfileType profile;
+				if (record.kind == Registry::Kind::Settings)
+				{
+					if (settings_offset)
+					{
+						// The older copy of settings recorded twice.
+						store.Remove(settings_offset);
+					}
+					settings_offset = record.offset;
+				}
+				else if (record.kind == Registry::Kind::Profile && DecodeProfile(record.payload, rank, profile))
+				{
+					auto [it, inserted] = offsets.try_emplace(profile.name, record.offset);
+					if (!inserted)
+					{
+						// The older copy of a profile recorded twice.
+						store.Remove(it->second);
+						it->second = record.offset;
+					}
+				}
+			}
+		}
+
+		SettingsType settings{};
+		bool has_settings = false;
+		std::vector<ProfileType> profiles;
+		// Rank of each profile, in step with profiles.
+		std::vector<uint64_t> ranks;
+		uint64_t next_rank = 0;
+		std::unordered_map<std::string, size_t> by_name;
+
+		// Guarded by mutex, with every change above.
+		Registry::Store store;
+		uint64_t settings_offset = 0;
+		std::unordered_map<std::string, uint64_t> offsets;
+		bool settings_dirty = false;
+		std::unordered_set<std::string> dirty;
+		std::chrono::steady_clock::time_point deadline;
+		std::mutex mutex;
+		std::condition_variable_any ready;
+		std::jthread worker;
+	};
+}
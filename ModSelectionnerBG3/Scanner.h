@@ -0,0 +1,238 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <windows.h>
+#include "CopyBackend.h"
+
+namespace fs = std::filesystem;
+
+// Bulk listing of a folder tree.
+// Each directory is read with GetFileInformationByHandleEx(FileIdBothDirectoryInfo),
+// which returns the size, last write time and file ID of dozens of entries per
+// call, where std::filesystem asks for them file by file. Directories are read
+// by a pool of workers, and the result is one flat, sorted array.
+// Times are FILETIME ticks, the unit of std::filesystem::file_time_type on
+// Windows, so they compare with manifest mtimes.
+// ReFS file IDs take 128 bits and their 64-bit form is not unique, so ReFS
+// folders are read with FileIdExtdDirectoryInfo, and a file whose ID does not
+// fit in 64 bits gets none.
+namespace Scanner
+{
+	constexpr DWORD BufferSize = 64 << 10;
+
+	// Names are kept in UTF-8 so that any file name, whatever the code page,
+	// survives in a manifest and converts back to the same path.
+	std::string NameOf(const fs::path& relative)
+	{
+		std::u8string name = relative.generic_u8string();
+		return std::string(name.begin(), name.end());
+	}
+
+	fs::path PathOf(std::string_view name)
+	{
+		return fs::path(std::u8string(name.begin(), name.end()));
+	}
+
+	struct Entry
+	{
+		// Path relative to the scanned root, with '/' separators, in UTF-8.
+		std::string name;
+		uintmax_t size = 0;
+		int64_t mtime = 0;
+		// 0 when unknown: the entry is a link, described through its target, or
+		// its ID does not fit in 64 bits.
+		uint64_t file_id = 0;
+	};
+
+	struct Result
+	{
+		uint64_t volume = 0;
+		std::vector<Entry> files;
+		std::vector<std::pair<fs::path, std::error_code>> errors;
+	};
+
+	uint64_t FileIdOf(const FILE_ID_BOTH_DIR_INFO& info)
+	{
+		return static_cast<uint64_t>(info.FileId.QuadPart);
+	}
+
+	uint64_t FileIdOf(const FILE_ID_EXTD_DIR_INFO& info)
+	{
+		uint64_t low = 0;
+		uint64_t high = 0;
+		std::memcpy(&low, info.FileId.Identifier, sizeof(low));
+		std::memcpy(&high, info.FileId.Identifier + sizeof(low), sizeof(high));
+		return high == 0 ? low : 0;
+	}
+
+	// Describes a file by opening it, for the entries whose listing describes a link rather than the file.
+	std::error_code DescribeByHandle(const fs::path& path, Entry& entry)
+	{
+		CopyBackend::FileHandle file(CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr));
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!file.IsValid() || !GetFileInformationByHandle(file.Get(), &info))
+		{
+			return CopyBackend::LastError();
+		}
+		entry.size = (static_cast<uintmax_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		entry.mtime = static_cast<int64_t>((static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime);
+		entry.file_id = 0;
+		return {};
+	}
+
+	// Lists every file below root on up to parallelism threads. Directory links
+	// and junctions below root are not followed; file links are listed with the
+	// size and time of their target. Directories that cannot be read are
+	// reported in errors and the rest of the tree is still listed.
+	Result Scan(const fs::path& root, unsigned parallelism = 0)
+	{
+		Result result;
+		CopyBackend::FileHandle root_handle(CreateFileW(root.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr));
+		BY_HANDLE_FILE_INFORMATION root_info;
+		if (!root_handle.IsValid() || !GetFileInformationByHandle(root_handle.Get(), &root_info))
+		{
+			std::error_code ec = CopyBackend::LastError();
+			if (fs::exists(root))
+			{
+				result.errors.push_back({ root, ec });
+			}
+			return result;
+		}
+		result.volume = root_info.dwVolumeSerialNumber;
+		wchar_t file_system[MAX_PATH + 1] = {};
+		bool full_ids = GetVolumeInformationByHandleW(root_handle.Get(), nullptr, 0, nullptr, nullptr, nullptr, file_system, MAX_PATH + 1) && std::wstring_view(file_system) == L"ReFS";
+		FILE_INFO_BY_HANDLE_CLASS restart_class = full_ids ? FileIdExtdDirectoryRestartInfo : FileIdBothDirectoryRestartInfo;
+		FILE_INFO_BY_HANDLE_CLASS next_class = full_ids ? FileIdExtdDirectoryInfo : FileIdBothDirectoryInfo;
+		root_handle.Close();
+
+		// Relative paths of the directories left to read.
+		std::deque<fs::path> queue{ fs::path() };
+		size_t busy = 0;
+		std::mutex mutex;
+		std::condition_variable ready;
+
+		auto work = [&]()
+			{
+				std::vector<unsigned long long> buffer(BufferSize / sizeof(unsigned long long));
+				for (;;)
+				{
+					fs::path relative;
+					{
+						std::unique_lock lock(mutex);
+						ready.wait(lock, [&]() { return !queue.empty() || busy == 0; });
+						if (queue.empty())
+						{
+							return;
+						}
+						relative = std::move(queue.front());
+						queue.pop_front();
+						busy++;
+					}
+
+					std::vector<Entry> files;
+					std::vector<fs::path> found;
+					std::vector<std::pair<fs::path, std::error_code>> errors;
+					fs::path directory = relative.empty() ? root : root / relative;
+					CopyBackend::FileHandle handle(CreateFileW(directory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr));
+					if (!handle.IsValid())
+					{
+						errors.push_back({ directory, CopyBackend::LastError() });
+					}
+
+					auto list = [&](const auto* info)
+						{
+							for (;; info = reinterpret_cast<decltype(info)>(reinterpret_cast<const char*>(info) + info->NextEntryOffset))
+							{
+								std::wstring file_name(info->FileName, info->FileNameLength / sizeof(WCHAR));
+								if (file_name != L"." && file_name != L"..")
+								{
+									fs::path child = relative / fs::path(file_name);
+									bool link = info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT;
+									if (info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+									{
+										if (!link)
+										{
+											found.push_back(child);
+										}
+									}
+									else
+									{
+										Entry entry{ .name = NameOf(child), .size = static_cast<uintmax_t>(info->EndOfFile.QuadPart), .mtime = info->LastWriteTime.QuadPart, .file_id = FileIdOf(*info) };
+										std::error_code ec = link ? DescribeByHandle(root / child, entry) : std::error_code();
+										if (ec)
+										{
+											errors.push_back({ root / child, ec });
+										}
+										else
+										{
+											files.push_back(std::move(entry));
+										}
+									}
+								}
+
+								if (info->NextEntryOffset == 0)
+								{
+									break;
+								}
+							}
+						};
+
+					for (FILE_INFO_BY_HANDLE_CLASS info_class = restart_class; handle.IsValid(); info_class = next_class)
+					{
+						if (!GetFileInformationByHandleEx(handle.Get(), info_class, buffer.data(), BufferSize))
+						{
+							if (GetLastError() != ERROR_NO_MORE_FILES)
+							{
+								errors.push_back({ directory, CopyBackend::LastError() });
+							}
+							break;
+						}
+
+						if (full_ids)
+						{
+							list(reinterpret_cast<const FILE_ID_EXTD_DIR_INFO*>(buffer.data()));
+						}
+						else
+						{
+							list(reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(buffer.data()));
+						}
+					}
+
+					{
+						std::lock_guard lock(mutex);
+						for (auto& child : found)
+						{
+							queue.push_back(std::move(child));
+						}
+						result.files.insert(result.files.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+						result.errors.insert(result.errors.end(), errors.begin(), errors.end());
+						busy--;
+					}
+					ready.notify_all();
+				}
+			};
+
+		unsigned workers = parallelism == 0 ? std::max(1u, std::thread::hardware_concurrency()) : parallelism;
+		{
+			std::vector<std::jthread> threads;
+			for (unsigned w = 1; w < workers; w++)
+			{
+				threads.emplace_back(work);
+			}
+			work();
+		}
+
+		std::sort(result.files.begin(), result.files.end(), [](const Entry& lhs, const Entry& rhs) { return lhs.name < rhs.name; });
+		return result;
+	}
+}
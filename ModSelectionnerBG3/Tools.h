@@ -171,6 +171,23 @@ std::string getSecureStringInput(
 
 
 
+std::string FormatBytes(uintmax_t bytes)
+{
+	constexpr const char* Units[] = { "B", "KB", "MB", "GB", "TB" };
+	double value = static_cast<double>(bytes);
+	size_t unit = 0;
+	while (value >= 1024.0 && unit < std::size(Units) - 1)
+	{
+		value /= 1024.0;
+		unit++;
+	}
+
+	std::ostringstream oss;
+	oss.precision(unit == 0 ? 0 : 2);
+	oss << std::fixed << value << " " << Units[unit];
+	return oss.str();
+}
+
 std::string SelectFolder(const char* defaultPath)
 {
 	if (!fs::exists(fs::path(defaultPath)))
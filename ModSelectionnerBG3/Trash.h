@@ -0,0 +1,186 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <filesystem>
+#include <windows.h>
+#include "BatchIo.h"
+
+namespace fs = std::filesystem;
+
+// Deferred deletion of whole trees.
+// A tree is first renamed into a hidden .trash folder beside it, which is
+// instant since it stays on the same volume, and its files are removed later
+// by a background thread throttled to a file budget so the game and the menu
+// keep the disk. Whatever is still in a trash folder when the program exits
+// is reclaimed on the next start.
+namespace Trash
+{
+	constexpr const char* TrashFolderName = ".trash";
+	constexpr size_t DefaultFilesPerSecond = 2000;
+	constexpr auto ThrottleSlice = std::chrono::milliseconds(50);
+
+	fs::path TrashFolder(const fs::path& path)
+	{
+		return path.parent_path() / TrashFolderName;
+	}
+
+	// Renames path into the trash folder beside it and returns its new location.
+	std::error_code MoveToTrash(const fs::path& path, fs::path& trashed)
+	{
+		fs::path trash = TrashFolder(path);
+		std::error_code ec;
+		fs::create_directories(trash, ec);
+		if (ec)
+		{
+			return ec;
+		}
+		SetFileAttributesW(trash.c_str(), FILE_ATTRIBUTE_HIDDEN);
+
+		trashed = trash / (path.filename().string() + "." + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()));
+		fs::rename(path, trashed, ec);
+		return ec;
+	}
+
+	class Reclaimer
+	{
+	public:
+		explicit Reclaimer(size_t files_per_second = DefaultFilesPerSecond)
+			: files_per_second(files_per_second)
+		{
+		}
+
+		~Reclaimer()
+		{
+			Stop();
+		}
+
+		// Queues tree for deletion. The worker starts with the first tree.
+		void Add(const fs::path& tree)
+		{
+			std::lock_guard lock(mutex);
+			pending.push_back(tree);
+			if (!worker.joinable())
+			{
+				worker = std::jthread([this](std::stop_token stop) { Run(stop); });
+			}
+			ready.notify_one();
+		}
+
+		// Queues every tree an earlier run left in trash.
+		void Resume(const fs::path& trash)
+		{
+			std::error_code ec;
+			for (auto it = fs::directory_iterator(trash, ec); !ec && it != fs::directory_iterator(); it.increment(ec))
+			{
+				Add(it->path());
+			}
+		}
+
+		// Waits until every queued tree is reclaimed or timeout has passed.
+		void Drain(std::chrono::milliseconds timeout)
+		{
+			std::unique_lock lock(mutex);
+			drained.wait_for(lock, timeout, [this]() { return pending.empty(); });
+		}
+
+		// Interrupts the reclaim and returns the number of trees left for the next start.
+		size_t Stop()
+		{
+			if (worker.joinable())
+			{
+				worker.request_stop();
+				worker.join();
+			}
+			std::lock_guard lock(mutex);
+			return pending.size();
+		}
+
+	private:
+		void Run(std::stop_token stop)
+		{
+			for (;;)
+			{
+				fs::path tree;
+				{
+					std::unique_lock lock(mutex);
+					if (!ready.wait(lock, stop, [this]() { return !pending.empty(); }))
+					{
+						return;
+					}
+					tree = pending.front();
+				}
+
+				if (!Reclaim(stop, tree))
+				{
+					return;
+				}
+
+				std::lock_guard lock(mutex);
+				pending.pop_front();
+				if (tree.parent_path().filename() == TrashFolderName)
+				{
+					// Only succeeds once the trash is empty.
+					std::error_code ec;
+					fs::remove(tree.parent_path(), ec);
+				}
+				drained.notify_all();
+			}
+		}
+
+		// Removes the files of tree at most files_per_second at a time, then its
+		// directories deepest first. Returns false when stopped halfway.
+		bool Reclaim(std::stop_token stop, const fs::path& tree)
+		{
+			auto start = std::chrono::steady_clock::now();
+			auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+			std::error_code ec;
+			if (!fs::is_directory(fs::symlink_status(tree, ec)))
+			{
+				CopyBackend::RemoveFile(tree);
+				return true;
+			}
+
+			std::vector<fs::path> directories{ tree };
+			size_t removed = 0;
+			for (auto it = fs::recursive_directory_iterator(tree, fs::directory_options::skip_permission_denied, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+			{
+				if (it->is_directory() && !it->is_symlink())
+				{
+					directories.push_back(it->path());
+					continue;
+				}
+				CopyBackend::RemoveFile(it->path());
+
+				removed++;
+				double budget_seconds = static_cast<double>(removed) / files_per_second;
+				while (elapsed() < budget_seconds && !stop.stop_requested())
+				{
+					std::this_thread::sleep_for(ThrottleSlice);
+				}
+				if (stop.stop_requested())
+				{
+					return false;
+				}
+			}
+
+			for (auto it = directories.rbegin(); it != directories.rend(); ++it)
+			{
+				CopyBackend::RemoveFile(*it);
+			}
+			return true;
+		}
+
+		size_t files_per_second;
+		std::deque<fs::path> pending;
+		std::mutex mutex;
+		std::condition_variable_any ready;
+		std::condition_variable drained;
+		std::jthread worker;
+	};
+}